@@ -2,8 +2,8 @@
 section .multiboot
     align 4
     dd 0x1BADB002          ; Magic number that GRUB looks for to identify kernel
-    dd 0x0                 ; Flags (0 = no special requirements)
-    dd -(0x1BADB002 + 0x0) ; Checksum to validate header integrity
+    dd 0x2                 ; Flags (bit 1 = provide memory info and memory map)
+    dd -(0x1BADB002 + 0x2) ; Checksum to validate header integrity
 
 ; Main code section - contains all executable instructions
 section .text
@@ -14,7 +14,7 @@ section .text
 section .bss
     align 16                ; Align stack to 16-byte boundary
 stack_bottom:
-    resb 4096              ; Reserve 4KB (4096 bytes) for stack space
+    resb 16384             ; Reserve 16KB for stack space (shell and nested page faults run on it)
 stack_top:                  ; Top of stack (ESP will point here)
 
 ; Now all the actual code and data
@@ -28,9 +28,10 @@ start:
     extern __bss_end        ; Symbol from linker script: end of .bss section
     
     ; GRUB passes multiboot info in EBX register
-    ; We need to save it before calling C functions
-    push ebx                ; Save multiboot info pointer
-    push eax                ; Save multiboot magic number
+    ; We need to save it before calling C functions; the stack lives in .bss,
+    ; so keep both values in registers that rep stosd leaves alone
+    mov esi, ebx            ; Save multiboot info pointer
+    mov edx, eax            ; Save multiboot magic number
     
     ; ------------------------------------------------------
     ; Zero the .bss section (all uninitialized globals/statics)
@@ -45,7 +46,9 @@ start:
     ; ------------------------------------------------------
     
     ; Set up stack - ESP points to top of stack (stacks grow downward), load GDT need to use stack
-    mov esp, stack_top      ; Set stack pointer to top of our 4KB stack area
+    mov esp, stack_top      ; Set stack pointer to top of our 16KB stack area
+    push esi                ; kernel_main 2nd argument: multiboot info pointer
+    push edx                ; kernel_main 1st argument: multiboot magic number
     
     ; Load and activate Global Descriptor Table (GDT)
     ; GDT defines memory segments and their permissions for protected mode
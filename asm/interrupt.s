@@ -1,7 +1,6 @@
 section .text
     global idt_load
-    global keyboard_handler_asm
-    global page_fault_handler_asm
+    global isr_stub_table
 
 ; Load the IDT
 idt_load:
@@ -9,56 +8,40 @@ idt_load:
     lidt [idtp]
     ret
 
-; Keyboard interrupt handler wrapper
-keyboard_handler_asm:
-    ; Save registers (don't push esp as it can cause issues)
-    push eax
-    push ebx
-    push ecx
-    push edx
-    push esi
-    push edi
-    push ebp
-    
-    ; Call C handler
-    extern keyboard_handler
-    call keyboard_handler
-    
-    ; Restore registers
-    pop ebp
-    pop edi
-    pop esi
-    pop edx
-    pop ecx
-    pop ebx
-    pop eax
-    
-    ; Return from interrupt
+; One stub per vector. Each leaves the same frame for irq_dispatch: the CPU's
+; eflags/cs/eip, an error code (the CPU's, or a dummy 0 for the vectors that
+; have none), the vector number, then the general registers (struct regs).
+%assign vec 0
+%rep 256
+isr_stub_%+vec:
+%if !(vec == 8 || (vec >= 10 && vec <= 14) || vec == 17 || vec == 21 || vec == 29 || vec == 30)
+    push dword 0
+%endif
+    push dword vec
+    jmp isr_common
+%assign vec vec+1
+%endrep
+
+; Common path: save registers, call the C dispatcher with a pointer to them,
+; restore, drop the vector and error code and return from interrupt
+isr_common:
+    pushad
+    cld
+
+    extern irq_dispatch
+    push esp
+    call irq_dispatch
+    add esp, 4
+
+    popad
+    add esp, 8
     iret
 
-; Page fault handler wrapper
-page_fault_handler_asm:
-    ; Save registers
-    push eax
-    push ebx
-    push ecx
-    push edx
-    push esi
-    push edi
-    push ebp
-    
-    ; Call C handler
-    extern page_fault_handler
-    call page_fault_handler
-    
-    ; Restore registers
-    pop ebp
-    pop edi
-    pop esi
-    pop edx
-    pop ecx
-    pop ebx
-    pop eax
-    
-    ; Return from interrupt
-    iret 
\ No newline at end of file
+; Stub addresses, indexed by vector, for interrupt_init to fill the IDT
+section .data
+isr_stub_table:
+%assign vec 0
+%rep 256
+    dd isr_stub_%+vec
+%assign vec vec+1
+%endrep
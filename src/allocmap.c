@@ -0,0 +1,91 @@
+#include "allocmap.h"
+#include "paging.h"
+
+uint32_t allocmap_init(struct allocmap *map, const char *name, uint32_t base, uint32_t end, uint32_t type)
+{
+	// One bit per granule of the whole range; the bitmap's own granules are never set
+	uint32_t words[ALLOCMAP_LEVELS];
+	uint32_t n = (((end - base) >> ALLOCMAP_SHIFT) + 31) / 32;
+	uint32_t bytes = 0;
+	for (int l = 0; l < ALLOCMAP_LEVELS; l++) {
+		words[l] = n;
+		bytes += n * 4;
+		n = (n + 31) / 32;
+	}
+	bytes = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (end - base <= bytes) return 0;
+	uint32_t bits = end - bytes;
+	if (vmm_region_add(name, bits, end, PAGE_WRITE, type, VM_LAZY | VM_ZERO, 1) != 0) return 0;
+	map->base = base;
+	map->limit = bits;
+	uint32_t p = bits;
+	for (int l = 0; l < ALLOCMAP_LEVELS; l++) {
+		map->level[l] = (uint32_t*)p;
+		p += words[l] * 4;
+	}
+	return bits;
+}
+
+static inline int allocmap_covers(const struct allocmap *map, uint32_t addr)
+{
+	return addr >= map->base && addr < map->limit;
+}
+
+void allocmap_set(struct allocmap *map, uint32_t addr)
+{
+	uint32_t idx = (addr - map->base) >> ALLOCMAP_SHIFT;
+	for (int l = 0; l < ALLOCMAP_LEVELS; l++) {
+		uint32_t *w = &map->level[l][idx >> 5];
+		uint32_t old = *w;
+		*w = old | (1u << (idx & 31));
+		// A word that already had bits is marked in the levels above
+		if (old) break;
+		idx >>= 5;
+	}
+}
+
+void allocmap_clear(struct allocmap *map, uint32_t addr)
+{
+	uint32_t idx = (addr - map->base) >> ALLOCMAP_SHIFT;
+	for (int l = 0; l < ALLOCMAP_LEVELS; l++) {
+		uint32_t *w = &map->level[l][idx >> 5];
+		*w &= ~(1u << (idx & 31));
+		if (*w) break;
+		idx >>= 5;
+	}
+}
+
+int allocmap_test(const struct allocmap *map, uint32_t addr)
+{
+	if (!allocmap_covers(map, addr) || (addr & (ALLOCMAP_GRANULE - 1))) return 0;
+	uint32_t idx = (addr - map->base) >> ALLOCMAP_SHIFT;
+	return (map->level[0][idx >> 5] >> (idx & 31)) & 1;
+}
+
+uint32_t allocmap_find(const struct allocmap *map, uint32_t addr)
+{
+	if (!allocmap_covers(map, addr)) return 0;
+	uint32_t idx = (addr - map->base) >> ALLOCMAP_SHIFT;
+	int l = 0;
+	// Climb: bits 0..idx of the word holding idx, else the words before it one level up
+	uint32_t word = map->level[0][idx >> 5] & ((2u << (idx & 31)) - 1);
+	while (!word && l < ALLOCMAP_LEVELS - 1) {
+		if (!(idx >> 5)) return 0;
+		idx = (idx >> 5) - 1;
+		l++;
+		word = map->level[l][idx >> 5] & ((2u << (idx & 31)) - 1);
+	}
+	// The top level is short enough to scan word by word
+	uint32_t w = idx >> 5;
+	while (!word) {
+		if (w == 0) return 0;
+		word = map->level[l][--w];
+	}
+	idx = (w << 5) + 31 - __builtin_clz(word);
+	// Descend: each summary bit names a non-empty word below, take its highest bit
+	while (l > 0) {
+		word = map->level[--l][idx];
+		idx = (idx << 5) + 31 - __builtin_clz(word);
+	}
+	return map->base + (idx << ALLOCMAP_SHIFT);
+}
@@ -0,0 +1,33 @@
+#ifndef ALLOCMAP_H
+#define ALLOCMAP_H
+
+#include <stdint.h>
+
+// Side bitmap of allocation starts: one bit per 8-byte granule of an allocator's
+// VA range. Validating a pointer is one bit test. Above the bitmap sit summary
+// levels with one bit per non-empty word of the level below, so an interior
+// pointer finds the previous set bit in a few word reads, however much free
+// space lies in between.
+#define ALLOCMAP_SHIFT   3
+#define ALLOCMAP_GRANULE (1u << ALLOCMAP_SHIFT)
+#define ALLOCMAP_LEVELS  4       // The bitmap and three summaries: 64 top words for 512MB
+
+struct allocmap {
+	uint32_t base;      // First covered address
+	uint32_t limit;     // End of the covered range
+	uint32_t *level[ALLOCMAP_LEVELS];   // level[0] is the bitmap itself
+};
+
+// Carve the bitmap for [base, end) out of the top of that range, as a lazy
+// zero-filled VM region, so only the part covering live allocations gets frames.
+// Returns the new end of the allocator's usable space, or 0 on failure.
+uint32_t allocmap_init(struct allocmap *map, const char *name, uint32_t base, uint32_t end, uint32_t type);
+
+void allocmap_set(struct allocmap *map, uint32_t addr);
+void allocmap_clear(struct allocmap *map, uint32_t addr);
+// Nonzero if an allocation starts exactly at addr
+int allocmap_test(const struct allocmap *map, uint32_t addr);
+// Closest allocation start at or below addr, or 0 if there is none
+uint32_t allocmap_find(const struct allocmap *map, uint32_t addr);
+
+#endif
@@ -0,0 +1,144 @@
+#include "allocprof.h"
+
+#if ALLOC_PROFILE
+
+uint32_t allocprof_tick = 0;
+
+// Sampled block, until it is freed
+struct live_block {
+	uint32_t ptr;          // 0: empty slot
+	uint32_t size;
+	uint32_t site;         // Index in sites[]
+};
+
+static struct allocprof_site sites[PROF_SITES];
+static struct live_block live[PROF_LIVE];
+static struct allocprof_stats stats[PROF_ALLOCATORS];
+
+// Both tables use open addressing with linear probing
+static inline uint32_t hash_addr(uint32_t addr, uint32_t slots)
+{
+	return (addr * 2654435761u) >> (32 - __builtin_ctz(slots));
+}
+
+static int site_index(uint32_t allocator, void *site)
+{
+	uint32_t i = hash_addr((uint32_t)site, PROF_SITES);
+	for (uint32_t n = 0; n < PROF_SITES; n++, i = (i + 1) & (PROF_SITES - 1)) {
+		if (sites[i].site == site) return i;
+		if (!sites[i].site) {
+			sites[i].site = site;
+			sites[i].allocator = allocator;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int live_find(uint32_t ptr)
+{
+	uint32_t i = hash_addr(ptr, PROF_LIVE);
+	for (uint32_t n = 0; n < PROF_LIVE && live[i].ptr; n++, i = (i + 1) & (PROF_LIVE - 1)) {
+		if (live[i].ptr == ptr) return i;
+	}
+	return -1;
+}
+
+// Backward-shift deletion keeps probe chains intact without tombstones
+static void live_remove(uint32_t i)
+{
+	uint32_t j = i;
+	for (;;) {
+		live[i].ptr = 0;
+		uint32_t home;
+		do {
+			j = (j + 1) & (PROF_LIVE - 1);
+			if (!live[j].ptr) return;
+			home = hash_addr(live[j].ptr, PROF_LIVE);
+			// Entry j may move into the hole at i only if its home is not in (i, j]
+		} while (i <= j ? (i < home && home <= j) : (i < home || home <= j));
+		live[i] = live[j];
+		i = j;
+	}
+}
+
+static void latency_add(struct allocprof_latency *lat, uint64_t t0)
+{
+	uint32_t cycles = (uint32_t)(rdtsc() - t0);
+	if (lat->count == 0 || cycles < lat->min) lat->min = cycles;
+	if (cycles > lat->max) lat->max = cycles;
+	lat->total += cycles;
+	lat->count++;
+}
+
+int allocprof_tracked(const void *ptr)
+{
+	return live_find((uint32_t)ptr) >= 0;
+}
+
+void allocprof_alloc(uint32_t allocator, void *site, const void *ptr, size_t size, uint64_t t0)
+{
+	if (!t0 || !ptr) return;
+	struct allocprof_stats *st = &stats[allocator];
+	latency_add(&st->alloc, t0);
+	st->size_hist[size ? 31 - __builtin_clz(size) : 0]++;
+
+	int s = site_index(allocator, site);
+	uint32_t i = hash_addr((uint32_t)ptr, PROF_LIVE);
+	uint32_t n = 0;
+	while (n < PROF_LIVE && live[i].ptr) {
+		i = (i + 1) & (PROF_LIVE - 1);
+		n++;
+	}
+	if (s < 0 || n == PROF_LIVE) {
+		st->untracked++;
+		return;
+	}
+	live[i].ptr = (uint32_t)ptr;
+	live[i].size = size;
+	live[i].site = s;
+	struct allocprof_site *cs = &sites[s];
+	cs->count++;
+	cs->total_bytes += size;
+	cs->live_bytes += size;
+	if (cs->live_bytes > cs->peak_bytes) cs->peak_bytes = cs->live_bytes;
+}
+
+void allocprof_free(uint32_t allocator, const void *ptr, uint64_t t0)
+{
+	int i = ptr ? live_find((uint32_t)ptr) : -1;
+	if (i < 0) return;
+	if (t0) latency_add(&stats[allocator].free, t0);
+	sites[live[i].site].live_bytes -= live[i].size;
+	live_remove(i);
+}
+
+uint32_t allocprof_top(struct allocprof_site *out, uint32_t max)
+{
+	// Insertion sort into out; the table is small
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < PROF_SITES; i++) {
+		if (!sites[i].site) continue;
+		uint32_t j = n < max ? n++ : max;
+		while (j > 0 && out[j - 1].live_bytes < sites[i].live_bytes) {
+			if (j < max) out[j] = out[j - 1];
+			j--;
+		}
+		if (j < max) out[j] = sites[i];
+	}
+	return n;
+}
+
+const struct allocprof_stats *allocprof_stats(uint32_t allocator)
+{
+	return allocator < PROF_ALLOCATORS ? &stats[allocator] : 0;
+}
+
+void allocprof_reset(void)
+{
+	for (uint32_t i = 0; i < PROF_SITES; i++) sites[i] = (struct allocprof_site){ 0 };
+	for (uint32_t i = 0; i < PROF_LIVE; i++) live[i] = (struct live_block){ 0 };
+	for (uint32_t i = 0; i < PROF_ALLOCATORS; i++) stats[i] = (struct allocprof_stats){ 0 };
+}
+
+#endif
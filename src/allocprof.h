@@ -0,0 +1,93 @@
+#ifndef ALLOCPROF_H
+#define ALLOCPROF_H
+
+#include "kernel.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// Allocation profiler for kmalloc and vmalloc, selected at build time:
+//   make ALLOC_PROFILE=0   compiled out (default), the hooks below are empty inlines
+//   make ALLOC_PROFILE=1   every allocation is profiled
+//   make ALLOC_PROFILE=N   1 in N allocations is sampled, and so is the free of each sampled block
+#ifndef ALLOC_PROFILE
+#define ALLOC_PROFILE 0
+#endif
+
+enum {
+	PROF_KMALLOC,
+	PROF_VMALLOC,
+	PROF_ALLOCATORS
+};
+
+#define PROF_SITES      64      // Call sites tracked, per build
+#define PROF_LIVE       2048    // Sampled blocks tracked until they are freed
+#define PROF_SIZE_BINS  32      // Power-of-two size classes
+
+// Per call site counters; live/peak are in requested bytes
+struct allocprof_site {
+	void *site;                 // Return address of the allocation call
+	uint32_t allocator;
+	uint32_t count;
+	uint32_t live_bytes;
+	uint32_t peak_bytes;
+	uint32_t total_bytes;
+};
+
+struct allocprof_latency {
+	uint32_t min, max, count;
+	uint64_t total;
+};
+
+struct allocprof_stats {
+	struct allocprof_latency alloc;
+	struct allocprof_latency free;
+	uint32_t size_hist[PROF_SIZE_BINS];   // Bin i: sizes in [2^i, 2^(i+1))
+	uint32_t untracked;                   // Sampled blocks that did not fit the live table
+};
+
+#if ALLOC_PROFILE
+
+extern uint32_t allocprof_tick;
+
+// Start timing an allocation; 0 if it is not sampled
+static inline uint64_t allocprof_begin(void)
+{
+#if ALLOC_PROFILE > 1
+	if (++allocprof_tick < ALLOC_PROFILE) return 0;
+	allocprof_tick = 0;
+#endif
+	return rdtsc();
+}
+
+int allocprof_tracked(const void *ptr);
+
+// Start timing a free; 0 unless the block was sampled when it was allocated
+static inline uint64_t allocprof_free_begin(const void *ptr)
+{
+	return ptr && allocprof_tracked(ptr) ? rdtsc() : 0;
+}
+
+void allocprof_alloc(uint32_t allocator, void *site, const void *ptr, size_t size, uint64_t t0);
+void allocprof_free(uint32_t allocator, const void *ptr, uint64_t t0);
+
+// Call sites sorted by live bytes, largest first; returns how many were copied
+uint32_t allocprof_top(struct allocprof_site *out, uint32_t max);
+const struct allocprof_stats *allocprof_stats(uint32_t allocator);
+void allocprof_reset(void);
+
+#else
+
+static inline uint64_t allocprof_begin(void) { return 0; }
+static inline uint64_t allocprof_free_begin(const void *ptr) { (void)ptr; return 0; }
+static inline void allocprof_alloc(uint32_t allocator, void *site, const void *ptr, size_t size, uint64_t t0)
+{
+	(void)allocator; (void)site; (void)ptr; (void)size; (void)t0;
+}
+static inline void allocprof_free(uint32_t allocator, const void *ptr, uint64_t t0)
+{
+	(void)allocator; (void)ptr; (void)t0;
+}
+
+#endif
+
+#endif
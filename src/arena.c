@@ -0,0 +1,93 @@
+#include "arena.h"
+#include "pmm.h"
+
+// Header at the start of each chunk
+struct arena_chunk {
+	struct arena_chunk *next;
+	uint32_t order;
+};
+
+static struct arena_chunk *chunk_new(uint32_t order)
+{
+	struct arena_chunk *c = (struct arena_chunk*)pmm_alloc_pages(order);
+	if (!c) return 0;
+	pmm_set_page_type(c, PG_ARENA);
+	c->next = 0;
+	c->order = order;
+	return c;
+}
+
+// Smallest order whose chunk holds `bytes` after the chunk header
+static uint32_t chunk_order(size_t bytes)
+{
+	uint32_t order = 0;
+	while (order < ARENA_MAX_ORDER && (PAGE_SIZE << order) - sizeof(struct arena_chunk) < bytes) order++;
+	return order;
+}
+
+static void arena_use_chunk(struct arena *a, struct arena_chunk *c, uint8_t *start)
+{
+	a->cur = c;
+	a->ptr = start;
+	a->end = (uint8_t*)c + (PAGE_SIZE << c->order);
+}
+
+struct arena *arena_create(size_t initial)
+{
+	size_t header = sizeof(struct arena_chunk) + sizeof(struct arena);
+	struct arena_chunk *c = chunk_new(chunk_order(initial + sizeof(struct arena)));
+	if (!c) return 0;
+	struct arena *a = (struct arena*)(c + 1);
+	a->first = c;
+	a->chunks = a->peak_chunks = 1;
+	a->allocs = a->bytes = 0;
+	arena_use_chunk(a, c, (uint8_t*)c + header);
+	return a;
+}
+
+void *arena_alloc(struct arena *a, size_t size, size_t align)
+{
+	if (align == 0) align = 8;
+	if (align & (align - 1)) return 0;
+	// size + align is used to size a new chunk: reject requests that would wrap it
+	if (size > 0xFFFFFFFFu - align) return 0;
+	uint8_t *p = (uint8_t*)(((uint32_t)a->ptr + align - 1) & ~(align - 1));
+	if (p > a->end || size > (size_t)(a->end - p)) {
+		// Chunks double up to ARENA_MAX_ORDER, and are at least big enough for the request
+		uint32_t order = a->cur->order < ARENA_MAX_ORDER ? a->cur->order + 1 : ARENA_MAX_ORDER;
+		uint32_t need = chunk_order(size + align);
+		if (need > order) order = need;
+		if ((PAGE_SIZE << order) - sizeof(struct arena_chunk) < size + align) return 0;
+		struct arena_chunk *c = chunk_new(order);
+		if (!c) return 0;
+		a->cur->next = c;
+		arena_use_chunk(a, c, (uint8_t*)(c + 1));
+		if (++a->chunks > a->peak_chunks) a->peak_chunks = a->chunks;
+		p = (uint8_t*)(((uint32_t)a->ptr + align - 1) & ~(align - 1));
+	}
+	a->ptr = p + size;
+	a->allocs++;
+	a->bytes += size;
+	return p;
+}
+
+void arena_reset(struct arena *a)
+{
+	struct arena_chunk *c = a->first->next;
+	while (c) {
+		struct arena_chunk *next = c->next;
+		pmm_free_pages(c, c->order);
+		c = next;
+	}
+	a->first->next = 0;
+	a->chunks = 1;
+	a->allocs = a->bytes = 0;
+	arena_use_chunk(a, a->first, (uint8_t*)(a + 1));
+}
+
+void arena_destroy(struct arena *a)
+{
+	if (!a) return;
+	arena_reset(a);
+	pmm_free_pages(a->first, a->first->order);
+}
@@ -0,0 +1,32 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARENA_MAX_ORDER 6         // Chunks are at most 2^6 pages (256KB)
+
+struct arena_chunk;
+
+// Bump-pointer allocator over buddy chunks from the PMM. Objects are never freed
+// one by one: arena_reset() drops everything at once and keeps the first chunk
+// for the next round, arena_destroy() gives all chunks back.
+struct arena {
+	struct arena_chunk *first;  // Holds this struct; survives resets
+	struct arena_chunk *cur;
+	uint8_t *ptr;               // Next free byte in cur
+	uint8_t *end;
+	uint32_t chunks;
+	uint32_t peak_chunks;
+	uint32_t allocs;            // Since the last reset
+	uint32_t bytes;
+};
+
+// initial: bytes the first chunk should hold; NULL when out of memory
+struct arena *arena_create(size_t initial);
+// align: power of two, 0 for the default 8; NULL if the request does not fit a chunk
+void *arena_alloc(struct arena *a, size_t size, size_t align);
+void arena_reset(struct arena *a);
+void arena_destroy(struct arena *a);
+
+#endif
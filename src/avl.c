@@ -0,0 +1,108 @@
+#include "avl.h"
+
+static inline int height(const struct avl_node *n) { return n ? n->height : 0; }
+
+static void update(struct avl_node *n)
+{
+	int l = height(n->left), r = height(n->right);
+	n->height = 1 + (l > r ? l : r);
+}
+
+static struct avl_node *rotate_right(struct avl_node *n)
+{
+	struct avl_node *l = n->left;
+	n->left = l->right;
+	l->right = n;
+	update(n);
+	update(l);
+	return l;
+}
+
+static struct avl_node *rotate_left(struct avl_node *n)
+{
+	struct avl_node *r = n->right;
+	n->right = r->left;
+	r->left = n;
+	update(n);
+	update(r);
+	return r;
+}
+
+// Restore the height invariant at n after one of its subtrees changed by one level
+static struct avl_node *balance(struct avl_node *n)
+{
+	update(n);
+	int diff = height(n->left) - height(n->right);
+	if (diff > 1) {
+		if (height(n->left->left) < height(n->left->right)) n->left = rotate_left(n->left);
+		return rotate_right(n);
+	}
+	if (diff < -1) {
+		if (height(n->right->right) < height(n->right->left)) n->right = rotate_right(n->right);
+		return rotate_left(n);
+	}
+	return n;
+}
+
+static struct avl_node *insert(struct avl_node *root, struct avl_node *node, avl_cmp_t cmp)
+{
+	if (!root) {
+		node->left = node->right = 0;
+		node->height = 1;
+		return node;
+	}
+	if (cmp(node, root) < 0) root->left = insert(root->left, node, cmp);
+	else root->right = insert(root->right, node, cmp);
+	return balance(root);
+}
+
+// Detach the leftmost node of n's subtree into *min
+static struct avl_node *remove_min(struct avl_node *n, struct avl_node **min)
+{
+	if (!n->left) {
+		*min = n;
+		return n->right;
+	}
+	n->left = remove_min(n->left, min);
+	return balance(n);
+}
+
+static struct avl_node *remove_node(struct avl_node *root, struct avl_node *node, avl_cmp_t cmp)
+{
+	if (!root) return 0;
+	if (root != node) {
+		if (cmp(node, root) < 0) root->left = remove_node(root->left, node, cmp);
+		else root->right = remove_node(root->right, node, cmp);
+		return balance(root);
+	}
+	if (!root->left) return root->right;
+	if (!root->right) return root->left;
+	// Replace the node with its in-order successor
+	struct avl_node *succ;
+	struct avl_node *right = remove_min(root->right, &succ);
+	succ->left = root->left;
+	succ->right = right;
+	return balance(succ);
+}
+
+void avl_insert(struct avl_node **root, struct avl_node *node, avl_cmp_t cmp)
+{
+	*root = insert(*root, node, cmp);
+}
+
+void avl_remove(struct avl_node **root, struct avl_node *node, avl_cmp_t cmp)
+{
+	*root = remove_node(*root, node, cmp);
+}
+
+struct avl_node *avl_first(struct avl_node *root)
+{
+	while (root && root->left) root = root->left;
+	return root;
+}
+
+struct avl_node *avl_last(struct avl_node *root)
+{
+	while (root && root->right) root = root->right;
+	return root;
+}
@@ -0,0 +1,24 @@
+#ifndef AVL_H
+#define AVL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Intrusive AVL tree: embed a struct avl_node in the object and recover the
+// object with avl_entry(). Keys must be unique under the comparator.
+struct avl_node {
+	struct avl_node *left;
+	struct avl_node *right;
+	int height;
+};
+
+typedef int (*avl_cmp_t)(const struct avl_node *a, const struct avl_node *b);
+
+#define avl_entry(node, type, member) ((type*)((uint8_t*)(node) - offsetof(type, member)))
+
+void avl_insert(struct avl_node **root, struct avl_node *node, avl_cmp_t cmp);
+void avl_remove(struct avl_node **root, struct avl_node *node, avl_cmp_t cmp);
+struct avl_node *avl_first(struct avl_node *root);
+struct avl_node *avl_last(struct avl_node *root);
+
+#endif
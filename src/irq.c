@@ -0,0 +1,174 @@
+#include "irq.h"
+#include "kernel.h"
+#include "panic.h"
+#include "timer.h"
+
+struct irq_action {
+	irq_handler_t fn;
+	void *ctx;
+};
+
+// IDT and interrupt handlers
+struct idt_entry idt[IDT_ENTRIES];
+struct idt_ptr idtp;
+
+static struct irq_action actions[IDT_ENTRIES];
+static struct irq_stat stats[IDT_ENTRIES];
+
+extern uint32_t isr_stub_table[IDT_ENTRIES];
+
+static const char *const exception_names[EXCEPTION_COUNT] = {
+	"divide error", "debug", "NMI", "breakpoint", "overflow", "bound range exceeded",
+	"invalid opcode", "device not available", "double fault", "coprocessor segment overrun",
+	"invalid TSS", "segment not present", "stack fault", "general protection fault",
+	"page fault", "reserved", "x87 floating point", "alignment check", "machine check",
+	"SIMD floating point", "virtualization", "control protection", "reserved", "reserved",
+	"reserved", "reserved", "reserved", "reserved", "hypervisor injection",
+	"VMM communication", "security", "reserved",
+};
+
+static const char *const irq_names[16] = {
+	"IRQ0", "IRQ1", "IRQ2", "IRQ3", "IRQ4", "IRQ5", "IRQ6", "IRQ7",
+	"IRQ8", "IRQ9", "IRQ10", "IRQ11", "IRQ12", "IRQ13", "IRQ14", "IRQ15",
+};
+
+void pic_init(void)
+{
+	// ICW1: start initialization sequence
+	outb(PIC1_COMMAND, ICW1_INIT | ICW1_ICW4);
+	outb(PIC2_COMMAND, ICW1_INIT | ICW1_ICW4);
+
+	// ICW2: remap IRQ table
+	outb(PIC1_DATA, IRQ0);     // IRQ 0-7 -> interrupts 32-39
+	outb(PIC2_DATA, IRQ8);     // IRQ 8-15 -> interrupts 40-47
+
+	// ICW3: tell PICs how they're cascaded
+	outb(PIC1_DATA, 4);        // IRQ2 connects to slave PIC
+	outb(PIC2_DATA, 2);        // slave PIC is connected to IRQ2
+
+	// ICW4: set 8086 mode
+	outb(PIC1_DATA, ICW4_8086);
+	outb(PIC2_DATA, ICW4_8086);
+
+	// mask all interrupts except keyboard (IRQ1)
+	outb(PIC1_DATA, 0xFD);     // enable IRQ1 (keyboard)
+	outb(PIC2_DATA, 0xFF);     // disable all IRQs on PIC2
+}
+
+// set up an IDT entry
+void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags)
+{
+	idt[num].base_lo = (base & 0xFFFF);
+	idt[num].base_hi = (base >> 16) & 0xFFFF;
+	idt[num].sel = sel;
+	idt[num].always0 = 0;
+	idt[num].flags = flags;
+}
+
+void interrupt_init(void)
+{
+	// set up IDT pointer
+	idtp.limit = (sizeof(struct idt_entry) * IDT_ENTRIES) - 1;
+	idtp.base = (uint32_t)&idt;
+
+	// Every vector gets a stub, so a stray exception or interrupt reaches
+	// irq_dispatch instead of an empty gate (which would triple fault)
+	for (int i = 0; i < IDT_ENTRIES; i++) {
+		idt_set_gate(i, isr_stub_table[i], 0x08, 0x8E);
+	}
+
+	// load the IDT
+	idt_load();
+
+	// initialize PIC
+	pic_init();
+
+	// enable interrupts
+	asm volatile("sti");
+}
+
+// Let a PIC line (0-15) through; lines of the slave also need the cascade (IRQ2)
+void pic_unmask(uint8_t irq)
+{
+	if (irq >= 8) {
+		outb(PIC2_DATA, inb(PIC2_DATA) & ~(1 << (irq - 8)));
+		irq = 2;
+	}
+	outb(PIC1_DATA, inb(PIC1_DATA) & ~(1 << irq));
+}
+
+void pic_send_eoi(uint8_t irq)
+{
+	if (irq >= 8) {
+		outb(PIC2_COMMAND, 0x20);
+	}
+	outb(PIC1_COMMAND, 0x20);
+}
+
+int irq_register(uint8_t vector, irq_handler_t fn, void *ctx)
+{
+	uint32_t flags = irq_save();
+	int busy = actions[vector].fn != 0;
+	if (!busy) {
+		actions[vector].ctx = ctx;
+		actions[vector].fn = fn;
+	}
+	irq_restore(flags);
+	return busy ? -1 : 0;
+}
+
+static void unhandled(struct regs *r)
+{
+	uint32_t vector = r->vector;
+	if (vector < EXCEPTION_COUNT) {
+		kpanic_fatal("Exception %d (%s) at %x, error code %x\n", vector, exception_names[vector],
+		             r->eip, r->error);
+	}
+	if (vector <= IRQ15) {
+		// Nobody asked for this line. IRQ7 and IRQ15 are where the PIC reports
+		// spurious interrupts: those must not be acknowledged on their own chip
+		uint8_t irq = vector - IRQ0;
+		if (irq == 7) return;
+		if (irq == 15) {
+			outb(PIC1_COMMAND, 0x20);
+			return;
+		}
+		pic_send_eoi(irq);
+		return;
+	}
+	kpanic_fatal("Unexpected interrupt %d at %x\n", vector, r->eip);
+}
+
+void irq_dispatch(struct regs *r)
+{
+	uint32_t vector = r->vector & 0xFF;
+	uint64_t t0 = rdtsc();
+	// A device interrupt ends an idle halt: jiffies must be current before its
+	// handler runs. The timer does this itself, it needs to know whether its tick
+	// was stopped.
+	if (vector > IRQ0 && vector <= IRQ15) timer_idle_exit();
+
+	struct irq_action *a = &actions[vector];
+	if (a->fn) a->fn(r, a->ctx);
+	else unhandled(r);
+
+	uint32_t cycles = (uint32_t)(rdtsc() - t0);
+	struct irq_stat *st = &stats[vector];
+	st->count++;
+	st->cycles += cycles;
+	if (cycles > st->max_cycles) st->max_cycles = cycles;
+}
+
+void irq_stat_get(uint8_t vector, struct irq_stat *st)
+{
+	uint32_t flags = irq_save();
+	*st = stats[vector];
+	irq_restore(flags);
+}
+
+const char *irq_name(uint8_t vector)
+{
+	if (vector < EXCEPTION_COUNT) return exception_names[vector];
+	if (vector <= IRQ15) return irq_names[vector - IRQ0];
+	return 0;
+}
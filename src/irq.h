@@ -0,0 +1,89 @@
+#ifndef IRQ_H
+#define IRQ_H
+
+#include <stdint.h>
+
+struct idt_entry {
+	uint16_t base_lo;
+	uint16_t sel;
+	uint8_t always0;
+	uint8_t flags;
+	uint16_t base_hi;
+} __attribute__((packed));
+
+struct idt_ptr {
+	uint16_t limit;
+	uint32_t base;
+} __attribute__((packed));
+
+#define IDT_ENTRIES 256
+#define EXCEPTION_COUNT 32       // Vectors 0-31 are CPU exceptions
+
+#define IRQ0 32
+#define IRQ1 33
+#define IRQ2 34
+#define IRQ3 35
+#define IRQ4 36
+#define IRQ5 37
+#define IRQ6 38
+#define IRQ7 39
+#define IRQ8 40
+#define IRQ9 41
+#define IRQ10 42
+#define IRQ11 43
+#define IRQ12 44
+#define IRQ13 45
+#define IRQ14 46
+#define IRQ15 47
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+
+#define ICW1_ICW4 0x01
+#define ICW1_SINGLE 0x02
+#define ICW1_INTERVAL4 0x04
+#define ICW1_LEVEL 0x08
+#define ICW1_INIT 0x10
+
+#define ICW4_8086 0x01
+#define ICW4_AUTO 0x02
+#define ICW4_BUF_SLAVE 0x08
+#define ICW4_BUF_MASTER 0x0C
+#define ICW4_SFNM 0x10
+
+// Frame built by the stubs in interrupt.s, lowest address first
+struct regs {
+	uint32_t edi, esi, ebp, esp, ebx, edx, ecx, eax;   // pushad
+	uint32_t vector;
+	uint32_t error;              // CPU error code, 0 for vectors without one
+	uint32_t eip, cs, eflags;    // Pushed by the CPU
+};
+
+// Runs with interrupts off; a PIC line's handler sends its own EOI
+typedef void (*irq_handler_t)(struct regs *r, void *ctx);
+
+struct irq_stat {
+	uint32_t count;
+	uint32_t max_cycles;         // Longest entry-to-exit time of the handler (TSC)
+	uint64_t cycles;
+};
+
+// Fill all 256 gates with the stubs, load the IDT, remap the PIC and enable interrupts
+void interrupt_init(void);
+void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
+void pic_init(void);
+void pic_unmask(uint8_t irq);
+void pic_send_eoi(uint8_t irq);
+
+// Returns -1 if the vector already has a handler
+int irq_register(uint8_t vector, irq_handler_t fn, void *ctx);
+void irq_dispatch(struct regs *r);
+void irq_stat_get(uint8_t vector, struct irq_stat *st);
+// "page fault", "IRQ1", ...; NULL for a software vector
+const char *irq_name(uint8_t vector);
+
+extern void idt_load(void);
+
+#endif
@@ -28,34 +28,106 @@ struct multiboot_info {
     uint32_t vbe_interface_len;
 };
 
+// Memory map entry, as laid out by the bootloader at mmap_addr
+struct multiboot_mmap_entry {
+    uint32_t size;          // Size of the entry, not counting this field
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed));
+
 #define MULTIBOOT_MAGIC 0x2BADB002
+#define MULTIBOOT_INFO_MEMORY      0x00000001  // mem_lower/mem_upper are valid
+#define MULTIBOOT_INFO_MEM_MAP     0x00000040  // mmap_addr/mmap_length are valid
+#define MULTIBOOT_MEMORY_AVAILABLE 1
 #define BOOTLOADER "GRUB"
 #define ARCHITECTURE "i386 (x86)"
 #define KERNEL_NAME "KrnL"
 
-// Memory zone boundaries (Fitted for 10MB total memory: 0x00000000 - 0x00A00000)
+// Physical memory below DIRECT_MAP_LIMIT is identity mapped; RAM above it is only
+// reachable through explicit mappings (kheap, vmalloc).
+#define DIRECT_MAP_LIMIT  0x38000000u  // 896MB
+// The top 8MB of the address space belong to paging (kmap window, recursive page tables)
+#define KERNEL_FIXMAP_START 0xFF800000u
+
+// Virtual memory layout, derived from the detected RAM size by memory_init().
+// All ranges are [start, end); zone starts are 4MB aligned.
+struct mem_layout {
+    uint32_t ram_bytes;       // Usable RAM reported by the bootloader
+    uint32_t direct_map_end;  // 0x00000000 - direct_map_end: identity mapped
+    uint32_t kheap_start, kheap_end;
+    uint32_t kvmem_start, kvmem_end;
+    uint32_t vmem_start, vmem_end;
+    uint32_t user_start, user_end;
+    uint32_t scratch_start, scratch_end;  // Never handed out; free for tests and temporary mappings
+};
+
+extern struct mem_layout mem_layout;
+
+// Memory zone boundaries
+#define DIRECT_MAP_END    (mem_layout.direct_map_end)
 #define KERNEL_ZONE_START 0x00000000
-#define KERNEL_ZONE_END   0x005FFFFF  // Kernel zone: 0x00000000 - 0x005FFFFF (6MB)
-#define USER_ZONE_START   0x00600000  // User zone: 0x00600000 - 0x00A00000 (4MB)
-#define USER_ZONE_END     0x00A00000
+#define KERNEL_ZONE_END   (mem_layout.kvmem_end - 1)   // Direct map, kmalloc and kernel vmalloc
+#define USER_ZONE_START   (mem_layout.vmem_start)      // User vmalloc and user processes
+#define USER_ZONE_END     (mem_layout.user_end)
+
+// Kernel zone allocator regions
+#define KHEAP_START       (mem_layout.kheap_start)     // kmalloc
+#define KHEAP_END         (mem_layout.kheap_end - 1)
+#define KVMEM_START       (mem_layout.kvmem_start)     // Kernel virtual memory
+#define KVMEM_END         (mem_layout.kvmem_end - 1)
 
-// Kernel zone allocator regions (fitted for 10MB total memory: 0x00000000 - 0x00A00000)
-#define KHEAP_START       0x00200000  // kmalloc: 1MB
-#define KHEAP_END         0x002FFFFF
-#define KVMEM_START       0x00300000  // Kernel virtual memory: 3MB (expanded)
-#define KVMEM_END         0x005FFFFF
+// User zone allocator regions
+#define VMEM_START        (mem_layout.vmem_start)      // vmalloc
+#define VMEM_END          (mem_layout.vmem_end - 1)
+#define USER_PROCESS_START (mem_layout.user_start)     // User processes (up to USER_ZONE_END)
 
-// User zone allocator regions (fitted for 10MB total memory)
-#define VMEM_START        0x00600000  // vmalloc: 1MB
-#define VMEM_END          0x006FFFFF
-#define USER_PROCESS_START 0x00700000  // User processes: 3MB (up to 0x00A00000)
+// Unmapped window for shell tests
+#define SCRATCH_START     (mem_layout.scratch_start)
+#define SCRATCH_END       (mem_layout.scratch_end)
 
 void kernel_main(); 
 
 extern void outb(uint16_t port, uint8_t val);
 
+static inline uint8_t inb(uint16_t port)
+{
+	uint8_t ret;
+	asm volatile("inb %1, %0" : "=a"(ret) : "Nd"(port));
+	return ret;
+}
+
+// Disable interrupts and return the previous EFLAGS, for code that races with IRQ handlers
+static inline uint32_t irq_save(void)
+{
+	uint32_t flags;
+	asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+	return flags;
+}
+
+static inline void irq_restore(uint32_t flags)
+{
+	if (flags & 0x200) asm volatile("sti" : : : "memory");
+}
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
 // Memory subsystem initialization
-void memory_init(uint32_t mem_bytes);
+void memory_init(uint32_t magic, struct multiboot_info *mbi);
+
+// Allocation that owns an address
+struct kptr_info {
+    const char *allocator;    // "kmalloc" (slab or heap) or "vmalloc"
+    void *start;
+    size_t size;
+};
+// 0 and *info filled in if addr lies inside a live allocation, -1 otherwise
+int kptr_owner(const void *addr, struct kptr_info *info);
 
 // User space support - removed umalloc, using vmalloc only
 
@@ -3,31 +3,32 @@
 #include "string.h"
 #include "kprintf.h"
 #include "keyboard.h"
+#include "irq.h"
 #include "shell.h"
 #include "panic.h"
 #include "pmm.h"
 #include "paging.h"
 #include "kheap.h"
+#include "ktime.h"
+#include "timer.h"
 
 // External symbols from GDT
 extern void *gdt;
 extern void *gdt_end;
 extern void gdt_setup_at_required_address(void);
 
-void kernel_main(uint32_t magic, uint32_t *multiboot_info) 
+void kernel_main(uint32_t magic, struct multiboot_info *multiboot_info) 
 {
-    // Suppress unused parameter warnings
-    (void)magic;
-    (void)multiboot_info;
-    
     // Copy GDT to required address 0x00000800
     gdt_setup_at_required_address();
     
     screen_init();
     keyboard_init();
     interrupt_init();
+    ktime_init();                        // Calibrates the TSC before anything takes timestamps
+    timer_init();
 
-    memory_init(PMM_MAX_BYTES);  // Use shared constant
+    memory_init(magic, multiboot_info);  // Sized from the bootloader memory map
 
     // Display GDT info
     // kprintf("GDT relocated to %x\n", 0x00000800);
@@ -38,8 +39,20 @@ void kernel_main(uint32_t magic, uint32_t *multiboot_info)
     shell_init();
     
     while (1) {
-        // halt and wait for interrupts
-        asm volatile("hlt");
+        // Keystrokes first: the line editor and the shell run here, with
+        // interrupts on, not in the keyboard IRQ
+        if (keyboard_drain()) continue;
+        // Spend idle time clearing frames for the zero pool
+        if (pmm_zero_pool_refill()) continue;
+        // Then halt with the periodic tick stopped until the next timer is due.
+        // Interrupts stay off from the last ring check to the hlt, so a key
+        // that arrives in between wakes us instead of waiting for the next tick
+        asm volatile("cli");
+        if (keyboard_pending()) {
+            asm volatile("sti");
+            continue;
+        }
+        timer_idle();
     }
 }
     
\ No newline at end of file
@@ -6,6 +6,17 @@ static char scancode_to_ascii(uint8_t scancode);
 
 struct keyboard_state keyboard_state = {0, 0, 0, 0};
 
+// Scancodes from IRQ1 to keyboard_drain: single producer (the IRQ handler moves
+// head), single consumer (the idle loop moves tail), so no lock is needed
+static struct {
+    uint8_t buf[KBD_RING_SIZE];
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t queued;
+    uint32_t dropped;       // Scancodes lost to a full ring
+    uint32_t max_depth;
+} kbd_ring;
+
 static const char ascii_table[128] = {
     0, 0, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b',
     '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', '[', ']', '\n',
@@ -22,102 +33,38 @@ static const char ascii_table_shift[128] = {
     '*', 0, ' '
 };
 
-// IDT and interrupt handlers
-struct idt_entry idt[256];
-struct idt_ptr idtp;
-
 // I/O functions
-static inline uint8_t inb(uint16_t port)
-{
-    uint8_t ret;
-    asm volatile("inb %1, %0" : "=a"(ret) : "Nd"(port));
-    return ret;
-}
-
 void outb(uint16_t port, uint8_t val)
 {
     asm volatile("outb %0, %1" : : "a"(val), "Nd"(port));
 }
 
-void pic_init(void)
+void keyboard_handler(struct regs *r __attribute__((unused)), void *ctx __attribute__((unused)))
 {
-    // ICW1: start initialization sequence
-    outb(PIC1_COMMAND, ICW1_INIT | ICW1_ICW4);
-    outb(PIC2_COMMAND, ICW1_INIT | ICW1_ICW4);
-    
-    // ICW2: remap IRQ table
-    outb(PIC1_DATA, IRQ0);     // IRQ 0-7 -> interrupts 32-39
-    outb(PIC2_DATA, IRQ8);     // IRQ 8-15 -> interrupts 40-47
-    
-    // ICW3: tell PICs how they're cascaded
-    outb(PIC1_DATA, 4);        // IRQ2 connects to slave PIC
-    outb(PIC2_DATA, 2);        // slave PIC is connected to IRQ2
-    
-    // ICW4: set 8086 mode
-    outb(PIC1_DATA, ICW4_8086);
-    outb(PIC2_DATA, ICW4_8086);
-    
-    // mask all interrupts except keyboard (IRQ1)
-    outb(PIC1_DATA, 0xFD);     // enable IRQ1 (keyboard)
-    outb(PIC2_DATA, 0xFF);     // disable all IRQs on PIC2
-}
-
-// set up an IDT entry */
-void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags)
-{
-    idt[num].base_lo = (base & 0xFFFF);
-    idt[num].base_hi = (base >> 16) & 0xFFFF;
-    idt[num].sel = sel;
-    idt[num].always0 = 0;
-    idt[num].flags = flags;
-}
-
-/* Initialize interrupts */
-void interrupt_init(void)
-{
-    // set up IDT pointer
-    idtp.limit = (sizeof(struct idt_entry) * 256) - 1;
-    idtp.base = (uint32_t)&idt;
-    
-    // clear the IDT
-    for (int i = 0; i < 256; i++) {
-        idt_set_gate(i, 0, 0, 0);
-    }
-    
-    // set up keyboard interrupt handler
-    idt_set_gate(IRQ1, (uint32_t)keyboard_handler_asm, 0x08, 0x8E);
-    
-    // set up page fault handler (interrupt 14)
-    extern void page_fault_handler_asm(void);
-    idt_set_gate(14, (uint32_t)page_fault_handler_asm, 0x08, 0x8E);
-    
-    // load the IDT
-    idt_load();
-    
-    // initialize PIC
-    pic_init();
-    
-    // enable interrupts
-    asm volatile("sti");
-}
-
-void pic_send_eoi(uint8_t irq)
-{
-    if (irq >= 8) {
-        outb(PIC2_COMMAND, 0x20);
+    uint8_t scancode = inb(0x60);
+    uint32_t head = kbd_ring.head;
+    uint32_t depth = head - kbd_ring.tail;
+    if (depth < KBD_RING_SIZE) {
+        kbd_ring.buf[head & (KBD_RING_SIZE - 1)] = scancode;
+        // The byte must be in place before the consumer can see the new head
+        asm volatile("" : : : "memory");
+        kbd_ring.head = head + 1;
+        if (depth + 1 > kbd_ring.max_depth) kbd_ring.max_depth = depth + 1;
+        kbd_ring.queued++;
+    } else {
+        kbd_ring.dropped++;
     }
-    outb(PIC1_COMMAND, 0x20);
+    pic_send_eoi(IRQ1);
 }
 
-void keyboard_handler(void)
+// Line editor, screen switching and the shell: runs from keyboard_drain, interrupts on
+static void keyboard_process(uint8_t scancode)
 {
-    uint8_t scancode = inb(0x60);
     static uint8_t extended = 0;
     
     // handle extended scancode prefix
     if (scancode == 0xE0) {
         extended = 1;
-        pic_send_eoi(IRQ1);
         return;
     }
     
@@ -133,7 +80,6 @@ void keyboard_handler(void)
                     break;
             }
             extended = 0;
-            pic_send_eoi(IRQ1);
             return;
         }
         switch (scancode) {
@@ -243,10 +189,35 @@ void keyboard_handler(void)
         }
     }
     
-    pic_send_eoi(IRQ1);
     extended = 0;
 }
 
+int keyboard_drain(void)
+{
+    int n = 0;
+    while (kbd_ring.tail != kbd_ring.head) {
+        uint8_t scancode = kbd_ring.buf[kbd_ring.tail & (KBD_RING_SIZE - 1)];
+        // Read the byte before handing its slot back to the producer
+        asm volatile("" : : : "memory");
+        kbd_ring.tail++;
+        keyboard_process(scancode);
+        n++;
+    }
+    return n;
+}
+
+int keyboard_pending(void)
+{
+    return kbd_ring.tail != kbd_ring.head;
+}
+
+void keyboard_ring_stats(uint32_t *queued, uint32_t *dropped, uint32_t *max_depth)
+{
+    *queued = kbd_ring.queued;
+    *dropped = kbd_ring.dropped;
+    *max_depth = kbd_ring.max_depth;
+}
+
 static char scancode_to_ascii(uint8_t scancode)
 {
     char c;
@@ -278,4 +249,6 @@ void keyboard_init(void)
     
     // wait for keyboard to be ready
     while (inb(0x64) & 0x02);
+
+    irq_register(IRQ1, keyboard_handler, NULL);
 } 
\ No newline at end of file
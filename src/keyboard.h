@@ -2,53 +2,7 @@
 #define KEYBOARD_H
 
 #include "kernel.h"
-
-struct idt_entry {
-    uint16_t base_lo;
-    uint16_t sel;
-    uint8_t always0;
-    uint8_t flags;
-    uint16_t base_hi;
-} __attribute__((packed));
-
-struct idt_ptr {
-    uint16_t limit;
-    uint32_t base;
-} __attribute__((packed));
-
-#define IRQ0 32
-#define IRQ1 33
-#define IRQ2 34
-#define IRQ3 35
-#define IRQ4 36
-#define IRQ5 37
-#define IRQ6 38
-#define IRQ7 39
-#define IRQ8 40
-#define IRQ9 41
-#define IRQ10 42
-#define IRQ11 43
-#define IRQ12 44
-#define IRQ13 45
-#define IRQ14 46
-#define IRQ15 47
-
-#define PIC1_COMMAND 0x20
-#define PIC1_DATA    0x21
-#define PIC2_COMMAND 0xA0
-#define PIC2_DATA    0xA1
-
-#define ICW1_ICW4 0x01
-#define ICW1_SINGLE 0x02
-#define ICW1_INTERVAL4 0x04
-#define ICW1_LEVEL 0x08
-#define ICW1_INIT 0x10
-
-#define ICW4_8086 0x01
-#define ICW4_AUTO 0x02
-#define ICW4_BUF_SLAVE 0x08
-#define ICW4_BUF_MASTER 0x0C
-#define ICW4_SFNM 0x10
+#include "irq.h"
 
 #define KEY_ESCAPE     0x01
 #define KEY_BACKSPACE  0x0E
@@ -81,15 +35,14 @@ struct keyboard_state {
     uint8_t extended_key;
 };
 
-void interrupt_init(void);
-void idt_set_gate(uint8_t num, uint32_t base, uint16_t sel, uint8_t flags);
-void keyboard_handler(void);
-void keyboard_init(void);
-void pic_init(void);
-void pic_send_eoi(uint8_t irq);
+#define KBD_RING_SIZE 256          // Scancodes buffered between IRQ1 and the idle loop (power of two)
 
-extern void idt_load(void);
-extern void keyboard_handler_asm(void);
-extern void page_fault_handler_asm(void);
+// IRQ1: only queues the scancode
+void keyboard_handler(struct regs *r, void *ctx);
+void keyboard_init(void);
+// Run the line editor and the shell on every queued scancode; returns how many
+int keyboard_drain(void);
+int keyboard_pending(void);
+void keyboard_ring_stats(uint32_t *queued, uint32_t *dropped, uint32_t *max_depth);
 
 #endif 
\ No newline at end of file
@@ -1,202 +1,605 @@
 #include "kheap.h"
+#include "slab.h"
 #include "paging.h"
 #include "pmm.h"
 #include "panic.h"
 #include "kprintf.h"
+#include "string.h"
+#include "allocmap.h"
+#include "allocprof.h"
 
+// Boundary-tagged block: an 8-byte header and an 8-byte footer around the payload.
+// The footer lets kfree find the previous block in O(1); free blocks keep their
+// free-list links at the start of the payload.
 typedef struct block_header {
-	size_t size;
-	int free;
+	uint32_t size;   // Payload size (multiple of 8) | BLOCK_FREE | BLOCK_ZEROED
 	uint32_t magic;  // Magic number for double free detection
-	struct block_header *next;
 } block_header_t;
 
+typedef struct block_footer {
+	uint32_t size;   // Copy of the header size word
+	uint32_t unused;
+} block_footer_t;
+
+typedef struct free_links {
+	block_header_t *next;
+	block_header_t *prev;
+} free_links_t;
+
+#define BLOCK_FREE      0x1u
+#define BLOCK_ZEROED    0x2u     // Free block whose payload is zero past its free links
+#define BLOCK_FLAGS     0x7u
+#define BLOCK_OVERHEAD  (sizeof(block_header_t) + sizeof(block_footer_t))
+#define BLOCK_MIN_SIZE  sizeof(free_links_t)
+
 #define MAGIC_ALLOCATED 0xDEADBEEF
 #define MAGIC_FREED     0xFEEED000
 
+// Two-level segregated fit (TLSF): the first level splits sizes by power of two,
+// the second level splits each power of two into TLSF_SL_COUNT linear classes.
+// Sizes below TLSF_SMALL_BLOCK share the first list row in 8-byte steps.
+#define TLSF_SL_LOG2      4
+#define TLSF_SL_COUNT     (1 << TLSF_SL_LOG2)
+#define TLSF_FL_SHIFT     (TLSF_SL_LOG2 + 3)
+#define TLSF_SMALL_BLOCK  (1 << TLSF_FL_SHIFT)
+#define TLSF_FL_COUNT     (32 - TLSF_FL_SHIFT + 1)
+
+// The heap starts with one chunk and grows or shrinks by whole chunks through
+// ksbrk(): a 4MB page when PSE is available, 64KB otherwise. Trailing free space
+// beyond KHEAP_TRIM_CHUNKS chunks is given back to the PMM.
+#define KHEAP_SMALL_CHUNK  0x00010000u
+#define KHEAP_LARGE_CHUNK  0x00400000u
+#define KHEAP_TRIM_CHUNKS  2
+
 static uint8_t *heap_base = 0;
-static size_t heap_size = 0;
+static size_t heap_size = 0;      // Current break - heap_base
 static size_t heap_used = 0;
-static block_header_t *free_list = 0;
+static uint32_t heap_chunk = 0;
+static int heap_zero_fill = 0;    // New chunks come from the PMM zero pool
+static uint32_t heap_limit = 0;   // Upper bound for heap_size: the zone minus its bitmap
+
+// Payload starts of allocated blocks, at the top of the heap zone
+static struct allocmap heap_map;
+
+static uint32_t fl_bitmap = 0;
+static uint32_t sl_bitmap[TLSF_FL_COUNT];
+static block_header_t *free_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+static inline uint32_t block_size(const block_header_t *blk) { return blk->size & ~BLOCK_FLAGS; }
+static inline int block_is_free(const block_header_t *blk) { return blk->size & BLOCK_FREE; }
+static inline int block_is_zeroed(const block_header_t *blk) { return blk->size & BLOCK_ZEROED; }
+static inline free_links_t *block_links(block_header_t *blk) { return (free_links_t*)(blk + 1); }
+static inline block_footer_t *block_footer(block_header_t *blk)
+{
+	return (block_footer_t*)((uint8_t*)(blk + 1) + block_size(blk));
+}
+static inline int fls32(uint32_t v) { return 31 - __builtin_clz(v); }
+
+// flags: BLOCK_FREE and BLOCK_ZEROED; the footer mirrors the header
+static void block_set(block_header_t *blk, uint32_t size, uint32_t flags)
+{
+	blk->size = size | (flags & BLOCK_FLAGS);
+	block_footer(blk)->size = blk->size;
+}
+
+// Physical neighbours, NULL at the heap edges
+static block_header_t *block_next(block_header_t *blk)
+{
+	uint8_t *next = (uint8_t*)(block_footer(blk) + 1);
+	return next < heap_base + heap_size ? (block_header_t*)next : 0;
+}
+
+static block_header_t *block_prev(block_header_t *blk)
+{
+	if ((uint8_t*)blk <= heap_base) return 0;
+	block_footer_t *foot = (block_footer_t*)blk - 1;
+	return (block_header_t*)((uint8_t*)blk - BLOCK_OVERHEAD - (foot->size & ~BLOCK_FLAGS));
+}
+
+static void mapping_insert(uint32_t size, int *fl, int *sl)
+{
+	if (size < TLSF_SMALL_BLOCK) {
+		*fl = 0;
+		*sl = size / (TLSF_SMALL_BLOCK / TLSF_SL_COUNT);
+	} else {
+		int f = fls32(size);
+		*sl = (size >> (f - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+		*fl = f - (TLSF_FL_SHIFT - 1);
+	}
+}
+
+// Round the request up to the next class, so any block found there fits
+static void mapping_search(uint32_t size, int *fl, int *sl)
+{
+	if (size >= TLSF_SMALL_BLOCK) size += (1u << (fls32(size) - TLSF_SL_LOG2)) - 1;
+	mapping_insert(size, fl, sl);
+}
+
+static void free_list_insert(block_header_t *blk)
+{
+	int fl, sl;
+	mapping_insert(block_size(blk), &fl, &sl);
+	free_links_t *links = block_links(blk);
+	links->prev = 0;
+	links->next = free_lists[fl][sl];
+	if (links->next) block_links(links->next)->prev = blk;
+	free_lists[fl][sl] = blk;
+	fl_bitmap |= 1u << fl;
+	sl_bitmap[fl] |= 1u << sl;
+}
+
+static void free_list_remove(block_header_t *blk)
+{
+	int fl, sl;
+	mapping_insert(block_size(blk), &fl, &sl);
+	free_links_t *links = block_links(blk);
+	if (links->prev) block_links(links->prev)->next = links->next;
+	else free_lists[fl][sl] = links->next;
+	if (links->next) block_links(links->next)->prev = links->prev;
+	if (!free_lists[fl][sl]) {
+		sl_bitmap[fl] &= ~(1u << sl);
+		if (!sl_bitmap[fl]) fl_bitmap &= ~(1u << fl);
+	}
+}
+
+// First non-empty list at or above (fl, sl), via the bitmaps
+static block_header_t *find_suitable(int fl, int sl)
+{
+	if (fl >= TLSF_FL_COUNT) return 0;
+	uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+	if (!sl_map) {
+		uint32_t fl_map = fl + 1 < 32 ? fl_bitmap & (~0u << (fl + 1)) : 0;
+		if (!fl_map) return 0;
+		fl = __builtin_ffs(fl_map) - 1;
+		sl_map = sl_bitmap[fl];
+	}
+	sl = __builtin_ffs(sl_map) - 1;
+	return free_lists[fl][sl];
+}
+
+void *ksbrk(int32_t increment)
+{
+	uint32_t old_brk = (uint32_t)heap_base + heap_size;
+	if (increment == 0) return (void*)old_brk;
+	// Whole pages only
+	uint32_t bytes = increment > 0 ? (uint32_t)increment : (uint32_t)-increment;
+	bytes = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uint32_t new_brk;
+	if (increment > 0) {
+		if (bytes > heap_limit - heap_size) return (void*)-1;
+		new_brk = old_brk + bytes;
+	} else {
+		if (bytes > heap_size) return (void*)-1;
+		new_brk = old_brk - bytes;
+	}
+	// The region maps new pages eagerly, and releases the frames of dropped ones
+	if (vmm_region_set_end(KHEAP_START, new_brk) != 0) return (void*)-1;
+	heap_size = new_brk - (uint32_t)heap_base;
+	return (void*)old_brk;
+}
+
+// Turn the space past the current break into a free block, merged with the last block
+static int heap_grow(uint32_t min_bytes)
+{
+	uint32_t grow = (min_bytes + heap_chunk - 1) & ~(heap_chunk - 1);
+	if (grow > heap_limit - heap_size) grow = heap_limit - heap_size;
+	if (grow < min_bytes) return -1;
+	block_header_t *blk = (block_header_t*)ksbrk(grow);
+	if (blk == (block_header_t*)-1) return -1;
+	block_set(blk, grow - BLOCK_OVERHEAD, BLOCK_FREE | (heap_zero_fill ? BLOCK_ZEROED : 0));
+	blk->magic = MAGIC_FREED;
+	block_header_t *prev = block_prev(blk);
+	if (prev && block_is_free(prev)) {
+		free_list_remove(prev);
+		block_set(prev, block_size(prev) + BLOCK_OVERHEAD + block_size(blk), BLOCK_FREE);
+		blk = prev;
+	}
+	free_list_insert(blk);
+	return 0;
+}
 
-// KHEAP_VIRTUAL_START and KHEAP_SIZE are now defined in kernel.h
-#define KHEAP_SIZE         (KHEAP_END - KHEAP_START + 1)  // 64MB total kernel heap size
+// Block that ends at the break
+static block_header_t *heap_last_block(void)
+{
+	block_footer_t *foot = (block_footer_t*)(heap_base + heap_size) - 1;
+	return (block_header_t*)((uint8_t*)foot - (foot->size & ~BLOCK_FLAGS) - sizeof(block_header_t));
+}
+
+// Shrink the heap to the given break, which must fall inside the free last block
+// and leave at least the minimum free block in it
+static int heap_shrink_to(uint32_t new_brk)
+{
+	block_header_t *last = heap_last_block();
+	if (!block_is_free(last) || new_brk < (uint32_t)last + BLOCK_OVERHEAD + BLOCK_MIN_SIZE) return -1;
+	free_list_remove(last);
+	block_set(last, new_brk - (uint32_t)last - BLOCK_OVERHEAD, BLOCK_FREE);
+	free_list_insert(last);
+	ksbrk(-(int32_t)((uint32_t)heap_base + heap_size - new_brk));
+	return 0;
+}
+
+// Return trailing free chunks to the PMM once they pile up, keeping one as slack
+static void heap_trim(void)
+{
+	block_header_t *last = heap_last_block();
+	if (!block_is_free(last)) return;
+	uint32_t tail = (uint32_t)heap_base + heap_size - (uint32_t)last;
+	if (tail < KHEAP_TRIM_CHUNKS * heap_chunk) return;
+	uint32_t release = (tail - heap_chunk) & ~(heap_chunk - 1);
+	if (release == 0 || release >= heap_size) return;
+	heap_shrink_to((uint32_t)heap_base + heap_size - release);
+}
 
 void kheap_init(void)
 {
-	// Pre-map the entire kernel heap region at boot time
+	// Map only the first chunk at boot; the heap grows on demand
 	heap_base = (uint8_t*)KHEAP_START;
-	heap_size = KHEAP_SIZE;
+	heap_size = 0;
 	heap_used = 0;
-	free_list = 0;
-	
-	// Map the entire kernel heap region to physical memory
-	size_t pages = KHEAP_SIZE / PAGE_SIZE;
-	for (size_t i = 0; i < pages; i++) {
-		void *phys = pmm_alloc_page();
-		if (!phys) {
-			kpanic_fatal("kheap_init: failed to allocate physical page %d\n", (int)i);
-		}
-		uint32_t v = KHEAP_START + (i * PAGE_SIZE);
-		if (vmm_map_page(v, (uint32_t)phys, PAGE_WRITE) != 0) {
-			kpanic_fatal("kheap_init: failed to map page at %x\n", v);
-		}
+	fl_bitmap = 0;
+	for (int fl = 0; fl < TLSF_FL_COUNT; fl++) {
+		sl_bitmap[fl] = 0;
+		for (int sl = 0; sl < TLSF_SL_COUNT; sl++) free_lists[fl][sl] = 0;
 	}
 	
-	// Initialize the free list with the entire heap
-	free_list = (block_header_t*)heap_base;
-	free_list->size = KHEAP_SIZE - sizeof(block_header_t);
-	free_list->free = 1;
-	free_list->next = 0;
+	uint32_t heap_end = allocmap_init(&heap_map, "kheap-map", KHEAP_START, KHEAP_END + 1, PG_HEAP);
+	if (!heap_end) kpanic_fatal("kheap_init: no room for the allocation bitmap\n");
+	heap_limit = heap_end - KHEAP_START;
+
+	// Chunks are 4MB pages when possible; a small zone falls back to small chunks
+	heap_chunk = KHEAP_SMALL_CHUNK;
+	if (vmm_large_pages_enabled() && heap_limit >= KHEAP_LARGE_CHUNK) heap_chunk = KHEAP_LARGE_CHUNK;
+
+	// Without 4MB pages, chunks are built from pre-zeroed frames so kzalloc can skip the clear
+	heap_zero_fill = heap_chunk != KHEAP_LARGE_CHUNK;
+
+	// The region follows the break and is mapped as it grows
+	if (vmm_region_add("kheap", KHEAP_START, KHEAP_START, PAGE_WRITE | PAGE_LARGE, PG_HEAP,
+	                   VM_EAGER | (heap_zero_fill ? VM_ZERO : 0), 1) != 0 ||
+	    heap_grow(heap_chunk) != 0) {
+		kpanic_fatal("kheap_init: failed to map heap at %x\n", KHEAP_START);
+	}
 	
-	kprintf("Kernel heap initialized: %x-%x (%d MB)\n", 
-	        KHEAP_START, KHEAP_END, KHEAP_SIZE / (1024*1024));
+	kprintf("Kernel heap initialized: %x-%x (%d KB mapped, grows to %d MB)\n", 
+	        KHEAP_START, KHEAP_END, heap_size / 1024, heap_limit / (1024*1024));
+}
+
+// Give the tail of a block back to the free lists if it is big enough to stand alone.
+// A zeroed block stays zeroed on both sides: the new tags land outside either payload.
+static void split_block(block_header_t *blk, uint32_t size)
+{
+	uint32_t total = block_size(blk);
+	if (total < size + BLOCK_OVERHEAD + BLOCK_MIN_SIZE) return;
+	uint32_t flags = blk->size & BLOCK_FLAGS;
+	block_set(blk, size, flags);
+	block_header_t *rest = (block_header_t*)(block_footer(blk) + 1);
+	block_set(rest, total - size - BLOCK_OVERHEAD, BLOCK_FREE | (flags & BLOCK_ZEROED));
+	rest->magic = MAGIC_FREED;
+	free_list_insert(rest);
+}
+
+// Move the start of a free block (already off the free lists) up to an aligned
+// payload, returning the leading gap to the free lists as a block of its own
+static block_header_t *block_align(block_header_t *blk, uint32_t align)
+{
+	uint32_t payload = (uint32_t)(blk + 1);
+	uint32_t aligned = (payload + align - 1) & ~(align - 1);
+	if (aligned == payload) return blk;
+	while (aligned - payload < BLOCK_OVERHEAD + BLOCK_MIN_SIZE) aligned += align;
+	uint32_t gap = aligned - payload;
+	uint32_t total = block_size(blk);
+	uint32_t flags = blk->size & BLOCK_FLAGS;
+	block_set(blk, gap - BLOCK_OVERHEAD, flags);
+	blk->magic = MAGIC_FREED;
+	free_list_insert(blk);
+	block_header_t *rest = (block_header_t*)aligned - 1;
+	block_set(rest, total - gap, flags);
+	return rest;
 }
 
-static void split_block(block_header_t *blk, size_t size)
+// Free block of at least size bytes, growing the heap if none is left; NULL when the zone is full
+static block_header_t *heap_find_block(uint32_t size)
 {
-	if (blk->size >= size + sizeof(block_header_t) + 16) {
-		block_header_t *n = (block_header_t*)((uint8_t*)blk + sizeof(block_header_t) + size);
-		n->size = blk->size - size - sizeof(block_header_t);
-		n->free = 1;
-		n->next = blk->next;
-		blk->size = size;
-		blk->next = n;
+	int fl, sl;
+	mapping_search(size, &fl, &sl);
+	block_header_t *blk = find_suitable(fl, sl);
+	if (!blk) {
+		// Grow the break; a free last block only needs topping up
+		uint32_t need = size + BLOCK_OVERHEAD;
+		block_header_t *last = heap_last_block();
+		if (block_is_free(last) && block_size(last) + BLOCK_OVERHEAD < need) need -= block_size(last) + BLOCK_OVERHEAD;
+		if (heap_grow(need) == 0) {
+			blk = heap_last_block();
+			if (block_size(blk) < size) blk = 0;
+		}
 	}
+	return blk;
 }
 
-void *kmalloc(size_t size)
+// Carve an allocated block with an align-aligned payload; *zeroed tells whether
+// the payload is known to be zero past its first BLOCK_MIN_SIZE bytes
+static void *heap_alloc(uint32_t size, uint32_t align, int *zeroed)
 {
-	if (size == 0) return 0;
-	// Round size up to the next multiple of 8 for alignment
+	if (size < BLOCK_MIN_SIZE) size = BLOCK_MIN_SIZE;
 	if (size & 7) size = (size + 7) & ~7u;
-	
-	block_header_t *cur = free_list;
-	while (cur) {
-		if (cur->free && cur->size >= size) {
-			split_block(cur, size);
-			cur->free = 0;
-			cur->magic = MAGIC_ALLOCATED;
-			heap_used += size + sizeof(block_header_t);
-			return (uint8_t*)cur + sizeof(block_header_t);
-		}
-		cur = cur->next;
+	// Room for the worst-case leading gap, which must hold a free block
+	uint32_t slack = align > 8 ? align + BLOCK_OVERHEAD + BLOCK_MIN_SIZE : 0;
+	block_header_t *blk = heap_find_block(size + slack);
+	if (!blk) return 0;
+	free_list_remove(blk);
+	if (align > 8) blk = block_align(blk, align);
+	*zeroed = block_is_zeroed(blk);
+	split_block(blk, size);
+	block_set(blk, block_size(blk), 0);
+	blk->magic = MAGIC_ALLOCATED;
+	allocmap_set(&heap_map, (uint32_t)(blk + 1));
+	heap_used += block_size(blk) + BLOCK_OVERHEAD;
+	return blk + 1;
+}
+
+// The public entry points at the end wrap these with the allocation profiler,
+// so that internal callers (krealloc, kcalloc) are not counted twice
+static void kfree_untracked(void *ptr);
+
+static void *kmalloc_untracked(size_t size)
+{
+	if (size == 0) return 0;
+	// Small sizes come from the kmalloc-N slab caches
+	if (size <= KMALLOC_MAX_SIZE) {
+		void *obj = kmalloc_slab(size);
+		if (!obj) kpanic_fatal("kmalloc: out of memory! Requested %d bytes, no slab page left\n", (int)size);
+		return obj;
 	}
-	
-	// No suitable block found - heap is full
-	kpanic_fatal("kmalloc: out of memory! Requested %d bytes, heap full\n", (int)size);
-	return 0; // Never reached
+	int zeroed;
+	void *ptr = size <= heap_limit ? heap_alloc(size, 8, &zeroed) : 0;
+	if (!ptr) {
+		// No suitable block found - heap is full
+		kpanic_fatal("kmalloc: out of memory! Requested %d bytes, heap full\n", (int)size);
+		return 0; // Never reached
+	}
+	return ptr;
 }
 
-void kfree(void *ptr)
+static void *kmalloc_aligned_untracked(size_t size, size_t align)
 {
-	if (!ptr) return;
-	block_header_t *blk = (block_header_t*)((uint8_t*)ptr - sizeof(block_header_t));
+	if (size == 0 || (align & (align - 1))) return 0;
+	// Slab objects and heap payloads are always 8-byte aligned
+	if (align <= 8) return kmalloc_untracked(size);
+	int zeroed;
+	void *ptr = size <= heap_limit && align <= heap_limit ? heap_alloc(size, align, &zeroed) : 0;
+	if (!ptr) {
+		kpanic_fatal("kmalloc_aligned: out of memory! Requested %d bytes aligned to %d\n", (int)size, (int)align);
+		return 0;
+	}
+	return ptr;
+}
+
+static void *kzalloc_untracked(size_t size)
+{
+	if (size == 0) return 0;
+	if (size <= KMALLOC_MAX_SIZE) {
+		void *obj = kmalloc_untracked(size);
+		memset(obj, 0, size);
+		return obj;
+	}
+	int zeroed;
+	void *ptr = size <= heap_limit ? heap_alloc(size, 8, &zeroed) : 0;
+	if (!ptr) {
+		kpanic_fatal("kzalloc: out of memory! Requested %d bytes, heap full\n", (int)size);
+		return 0;
+	}
+	// Fresh chunks only carry the old free-list links
+	memset(ptr, 0, zeroed ? BLOCK_MIN_SIZE : size);
+	return ptr;
+}
+
+static inline int heap_contains(uint32_t addr)
+{
+	return heap_base && addr >= (uint32_t)heap_base && addr < (uint32_t)heap_base + heap_size;
+}
+
+// Header of an allocated heap block; panics on a double free or a foreign pointer
+static block_header_t *heap_block_check(void *ptr, const char *who)
+{
+	block_header_t *blk = (block_header_t*)ptr - 1;
+	// The bitmap is authoritative; the magic only tells a double free from a stray pointer
+	if (allocmap_test(&heap_map, (uint32_t)ptr) && blk->magic == MAGIC_ALLOCATED) return blk;
+	uint32_t magic = heap_contains((uint32_t)blk) ? blk->magic : 0;
 	
 	// Check for double free
-    if (blk->magic == MAGIC_FREED) {
-        kpanic_fatal("kfree: double free detected at %p\n", (void*)ptr);
-        return;
+    if (magic == MAGIC_FREED) {
+        kpanic_fatal("%s: double free detected at %p\n", who, (void*)ptr);
+        return 0;
     }
 	
-	// Check for invalid magic number
-    if (blk->magic != MAGIC_ALLOCATED) {
-        kpanic_fatal("kfree: invalid memory block at %x (magic: %x)\n", (uint32_t)ptr, blk->magic);
-        return;
-    }
+	// Not the start of a live block
+    kpanic_fatal("%s: invalid memory block at %x (magic: %x)\n", who, (uint32_t)ptr, magic);
+    return 0;
+}
+
+// Resize an allocated block without moving it: absorb a free next block (or
+// move the break when the block is the last one), then split off the excess
+static int heap_resize(block_header_t *blk, uint32_t size)
+{
+	if (size < BLOCK_MIN_SIZE) size = BLOCK_MIN_SIZE;
+	if (size & 7) size = (size + 7) & ~7u;
+	uint32_t old = block_size(blk);
+	block_header_t *next = block_next(blk);
+	if (size > old) {
+		if (!next && heap_grow(size - old) == 0) next = block_next(blk);
+		if (!next || !block_is_free(next) || old + BLOCK_OVERHEAD + block_size(next) < size) return -1;
+	}
+	if (next && block_is_free(next)) {
+		free_list_remove(next);
+		block_set(blk, old + BLOCK_OVERHEAD + block_size(next), 0);
+	}
+	split_block(blk, size);
+	heap_used += block_size(blk) - old;
+	if (size < old) heap_trim();
+	return 0;
+}
+
+static void *krealloc_untracked(void *ptr, size_t size)
+{
+	if (!ptr) return kmalloc_untracked(size);
+	if (size == 0) {
+		kfree_untracked(ptr);
+		return 0;
+	}
+	uint32_t old;
+	struct kmem_cache *cache = kmem_cache_of(ptr);
+	if (cache) {
+		// The object already has room up to its cache size
+		if (size <= cache->size) return ptr;
+		old = cache->size;
+	} else {
+		block_header_t *blk = heap_block_check(ptr, "krealloc");
+		if (size <= heap_limit && heap_resize(blk, size) == 0) return ptr;
+		old = block_size(blk);
+	}
+	void *moved = kmalloc_untracked(size);
+	memcpy(moved, ptr, old < size ? old : size);
+	kfree_untracked(ptr);
+	return moved;
+}
+
+static void kfree_untracked(void *ptr)
+{
+	if (!ptr) return;
+	struct kmem_cache *cache = kmem_cache_of(ptr);
+	if (cache) {
+		kmem_cache_free(cache, ptr);
+		return;
+	}
+	block_header_t *blk = heap_block_check(ptr, "kfree");
+	if (!blk) return;
 	
 	// Mark as freed
-	blk->free = 1;
 	blk->magic = MAGIC_FREED;
-	heap_used -= blk->size + sizeof(block_header_t);
+	allocmap_clear(&heap_map, (uint32_t)ptr);
+	heap_used -= block_size(blk) + BLOCK_OVERHEAD;
 	
-	// If adjacent blocks are free, merge them, to reduce fragmentation
-	block_header_t *cur = free_list;
-	while (cur && cur->next) {
-		uint8_t *end_cur = (uint8_t*)cur + sizeof(block_header_t) + cur->size;
-		if (cur->free && cur->next->free && end_cur == (uint8_t*)cur->next) {
-			cur->size += sizeof(block_header_t) + cur->next->size;
-			cur->next = cur->next->next;
-		} else {
-			cur = cur->next;
-		}
+	// Merge with free physical neighbours, found through the boundary tags
+	block_header_t *next = block_next(blk);
+	if (next && block_is_free(next)) {
+		free_list_remove(next);
+		block_set(blk, block_size(blk) + BLOCK_OVERHEAD + block_size(next), 0);
 	}
+	block_header_t *prev = block_prev(blk);
+	if (prev && block_is_free(prev)) {
+		free_list_remove(prev);
+		block_set(prev, block_size(prev) + BLOCK_OVERHEAD + block_size(blk), 0);
+		blk = prev;
+	}
+	block_set(blk, block_size(blk), BLOCK_FREE);
+	free_list_insert(blk);
+	if (!block_next(blk)) heap_trim();
 }
 
-// Helper function to validate if a kernel heap block is properly allocated
-static int is_valid_kheap_block(block_header_t *blk)
+void *kmalloc(size_t size)
 {
-	// Check if block is within kernel heap region
-	uint32_t block_addr = (uint32_t)blk;
-	if (!heap_base || block_addr < (uint32_t)heap_base || block_addr >= (uint32_t)heap_base + heap_size) {
-		return 0; // Block is outside kernel heap region
-	}
-	
-	// Check if block header alignment is at least 8 bytes (heap guarantees 8-byte alignment)
-	if (block_addr & 7) {
-		return 0; // Block header is not 8-byte aligned
-	}
-	
-	// Check if block is linked in the free list (either allocated or free)
-	block_header_t *cur = free_list;
-	while (cur) {
-		if (cur == blk) {
-			return 1; // Found in free list
-		}
-		cur = cur->next;
+	uint64_t t0 = allocprof_begin();
+	void *ptr = kmalloc_untracked(size);
+	allocprof_alloc(PROF_KMALLOC, __builtin_return_address(0), ptr, size, t0);
+	return ptr;
+}
+
+void *kmalloc_aligned(size_t size, size_t align)
+{
+	uint64_t t0 = allocprof_begin();
+	void *ptr = kmalloc_aligned_untracked(size, align);
+	allocprof_alloc(PROF_KMALLOC, __builtin_return_address(0), ptr, size, t0);
+	return ptr;
+}
+
+void *kzalloc(size_t size)
+{
+	uint64_t t0 = allocprof_begin();
+	void *ptr = kzalloc_untracked(size);
+	allocprof_alloc(PROF_KMALLOC, __builtin_return_address(0), ptr, size, t0);
+	return ptr;
+}
+
+void *kcalloc(size_t n, size_t size)
+{
+	if (size && n > (size_t)-1 / size) {
+		kpanic_fatal("kcalloc: %d * %d bytes overflows\n", (int)n, (int)size);
+		return 0;
 	}
-	
-	// Also check if it's a recently allocated block that might not be in free list yet
-	// This is a simplified check - in a real implementation, you'd maintain an allocated list too
-	return 1; // Allow if within heap bounds and aligned
+	uint64_t t0 = allocprof_begin();
+	void *ptr = kzalloc_untracked(n * size);
+	allocprof_alloc(PROF_KMALLOC, __builtin_return_address(0), ptr, n * size, t0);
+	return ptr;
+}
+
+void *krealloc(void *ptr, size_t size)
+{
+	// Profiled as a free of the old block and an allocation of the new one
+	uint64_t t0 = allocprof_begin();
+	allocprof_free(PROF_KMALLOC, ptr, 0);
+	void *moved = krealloc_untracked(ptr, size);
+	allocprof_alloc(PROF_KMALLOC, __builtin_return_address(0), moved, size, t0);
+	return moved;
+}
+
+void kfree(void *ptr)
+{
+	uint64_t t0 = allocprof_free_begin(ptr);
+	kfree_untracked(ptr);
+	allocprof_free(PROF_KMALLOC, ptr, t0);
 }
 
 size_t ksize(void *ptr)
 {
 	if (!ptr) return 0;
+	struct kmem_cache *cache = kmem_cache_of(ptr);
+	if (cache) return cache->size;
 	
 	// Check if pointer is within kernel heap region
 	uint32_t ptr_addr = (uint32_t)ptr;
-	if (!heap_base || ptr_addr < (uint32_t)heap_base || ptr_addr >= (uint32_t)heap_base + heap_size) {
+	if (!heap_contains(ptr_addr)) {
 		kprintf("[ERROR]ksize: invalid pointer %x (outside kernel heap)\n", ptr_addr);
 		return 0; // Pointer is outside kernel heap region
 	}
 	
-	block_header_t *blk = (block_header_t*)((uint8_t*)ptr - sizeof(block_header_t));
-	
-	// Check if block is still allocated
-	if (blk->magic != MAGIC_ALLOCATED) {
-		kprintf("[ERROR] ksize: pointer %x refers to non-allocated block (magic=%x)\n", ptr_addr, blk->magic);
-		return 0; // Block is freed or invalid
-	}
-	
-	// Additional validation: check if block is properly allocated
-	if (!is_valid_kheap_block(blk)) {
-		kprintf("[ERROR] ksize: pointer %x fails allocation validation\n", ptr_addr);
-		return 0; // Block is not properly allocated
+	// Only the start of a live block has its bit set
+	if (!allocmap_test(&heap_map, ptr_addr)) {
+		kprintf("[ERROR] ksize: pointer %x is not the start of an allocated block\n", ptr_addr);
+		return 0; // Block is freed, or an interior/stray pointer
 	}
 	
-	return blk->size;
+	return block_size((block_header_t*)ptr - 1);
+}
+
+void *kheap_owner(const void *addr)
+{
+	if (!heap_contains((uint32_t)addr)) return 0;
+	uint32_t start = allocmap_find(&heap_map, (uint32_t)addr);
+	if (!start) return 0;
+	// Past the end of the closest block, addr is in free space or a block's tags
+	block_header_t *blk = (block_header_t*)start - 1;
+	return (uint32_t)addr < start + block_size(blk) ? (void*)start : 0;
 }
 
 void *kbrk(void *new_brk)
 {
+	uint32_t brk = (uint32_t)heap_base + heap_size;
 	if (new_brk == 0) {
-		// Return current break (end of used heap)
-		return (void*)((uint32_t)heap_base + heap_used);
+		// Return current break (end of the mapped heap)
+		return (void*)brk;
 	}
 	
-	uint32_t new_addr = (uint32_t)new_brk;
-	uint32_t heap_end = (uint32_t)heap_base + heap_size;
+	uint32_t new_addr = ((uint32_t)new_brk + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
 	
 	// Check if new break is within heap bounds
-	if (new_addr < (uint32_t)heap_base || new_addr > heap_end) {
+	if (new_addr < (uint32_t)heap_base || new_addr > (uint32_t)heap_base + heap_limit) {
 		return (void*)-1; // Invalid break
 	}
 	
-	// Update used heap size
-	heap_used = new_addr - (uint32_t)heap_base;
-	return new_brk;
+	// Growing adds free space; shrinking only cuts into a free tail
+	if (new_addr > brk && heap_grow(new_addr - brk) != 0) return (void*)-1;
+	if (new_addr < brk && heap_shrink_to(new_addr) != 0) return (void*)-1;
+	return (void*)((uint32_t)heap_base + heap_size);
 }
 
 uint32_t kheap_used_bytes(void)
@@ -8,7 +8,16 @@ void kheap_init(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 size_t ksize(void *ptr);
+// Resizes in place when the next block is free or the block ends at the break
+void *krealloc(void *ptr, size_t size);
+// align must be a power of two; the leading gap goes back to the free lists
+void *kmalloc_aligned(size_t size, size_t align);
+void *kzalloc(size_t size);
+void *kcalloc(size_t n, size_t size);
+// Start of the heap block containing addr (interior pointers included), or NULL
+void *kheap_owner(const void *addr);
 void *kbrk(void *new_brk);
+void *ksbrk(int32_t increment);   // Moves the heap break; returns the old one, or (void*)-1
 
 // Heap statistics
 uint32_t kheap_used_bytes(void);
@@ -0,0 +1,118 @@
+#include "ktime.h"
+#include "kernel.h"
+#include "kprintf.h"
+#include "panic.h"
+
+#define PIT_CH2_DATA   0x42
+#define PIT_COMMAND    0x43
+#define PIT_PORT_B     0x61      // Bit 0: channel 2 gate, bit 1: speaker, bit 5: channel 2 output
+// Polls of port B before giving up on a calibration run (each inb takes about 1us)
+#define KTIME_CALIB_SPINS 1000000
+// Frequency assumed when the PIT never answers
+#define KTIME_FALLBACK_KHZ 1000000
+
+static struct clocksource tsc = { .name = "tsc" };
+
+static void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+	asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+uint64_t div_u64_rem(uint64_t n, uint32_t d, uint32_t *rem)
+{
+	// Two 64/32 steps: the high word first, its remainder carried into the low one
+	uint32_t hi = (uint32_t)(n >> 32);
+	uint32_t q_hi = hi / d;
+	uint32_t r = hi % d;
+	uint32_t q_lo;
+	asm("divl %4" : "=a"(q_lo), "=d"(r) : "a"((uint32_t)n), "d"(r), "rm"(d));
+	if (rem) *rem = r;
+	return ((uint64_t)q_hi << 32) | q_lo;
+}
+
+// TSC cycles over one countdown of PIT channel 2, or 0 if its output never rises
+static uint32_t pit_calibrate_run(uint32_t latch)
+{
+	// Gate on, speaker off; mode 0 counts down once and raises OUT2 at zero
+	outb(PIT_PORT_B, (inb(PIT_PORT_B) & ~0x02) | 0x01);
+	outb(PIT_COMMAND, 0xB0);                // Channel 2, lobyte/hibyte, mode 0, binary
+	outb(PIT_CH2_DATA, latch & 0xFF);
+	outb(PIT_CH2_DATA, latch >> 8);
+	uint64_t t0 = rdtsc();
+	for (uint32_t spins = 0; !(inb(PIT_PORT_B) & 0x20); spins++) {
+		if (spins >= KTIME_CALIB_SPINS) return 0;
+	}
+	uint64_t cycles = rdtsc() - t0;
+	return cycles >> 32 ? 0 : (uint32_t)cycles;
+}
+
+// mult/shift for cycles -> ns: the largest shift whose mult still fits 32 bits
+static void clocksource_set_khz(struct clocksource *cs, uint32_t khz)
+{
+	uint32_t shift = 32;
+	uint64_t mult = div_u64_rem((uint64_t)1000000 << shift, khz, NULL);
+	while (shift > 1 && (mult >> 32)) {
+		shift--;
+		mult = div_u64_rem((uint64_t)1000000 << shift, khz, NULL);
+	}
+	cs->khz = khz;
+	cs->mult = (uint32_t)mult;
+	cs->shift = shift;
+}
+
+void ktime_init(void)
+{
+	uint32_t eax, ebx, ecx, edx;
+	cpuid(1, &eax, &ebx, &ecx, &edx);
+	if (!(edx & (1 << 4))) kpanic_fatal("ktime_init: the CPU has no TSC\n");
+	cpuid(0x80000000, &eax, &ebx, &ecx, &edx);
+	if (eax >= 0x80000007) {
+		cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+		tsc.invariant = (edx >> 8) & 1;
+	}
+
+	// Interrupts off so nothing stretches a run; keep the shortest one
+	uint32_t latch = PIT_HZ / (1000 / KTIME_CALIB_MS);
+	uint32_t best = 0;
+	uint32_t flags = irq_save();
+	for (int run = 0; run < KTIME_CALIB_RUNS; run++) {
+		uint32_t cycles = pit_calibrate_run(latch);
+		if (cycles && (!best || cycles < best)) best = cycles;
+	}
+	irq_restore(flags);
+
+	uint32_t khz = KTIME_FALLBACK_KHZ;
+	if (best) {
+		// The countdown lasts latch / PIT_HZ seconds
+		khz = (uint32_t)div_u64_rem((uint64_t)best * PIT_HZ, latch * 1000, NULL);
+		tsc.calibrated = 1;
+	}
+	clocksource_set_khz(&tsc, khz);
+	tsc.base = rdtsc();
+
+	kprintf("Clocksource: %s at %d kHz (%s, mult %d, shift %d)%s\n", tsc.name, tsc.khz,
+	        tsc.invariant ? "invariant" : "not invariant", tsc.mult, tsc.shift,
+	        tsc.calibrated ? "" : " - PIT calibration failed, frequency guessed");
+}
+
+uint64_t ktime_cycles_to_ns(uint64_t cycles)
+{
+	// Each half is a 32x32 product, so nothing overflows for any uptime
+	uint32_t hi = (uint32_t)(cycles >> 32), lo = (uint32_t)cycles;
+	return (((uint64_t)hi * tsc.mult) << (32 - tsc.shift)) + (((uint64_t)lo * tsc.mult) >> tsc.shift);
+}
+
+uint64_t ktime_cycles(void)
+{
+	return rdtsc() - tsc.base;
+}
+
+uint64_t ktime_ns(void)
+{
+	return ktime_cycles_to_ns(ktime_cycles());
+}
+
+const struct clocksource *ktime_clocksource(void)
+{
+	return &tsc;
+}
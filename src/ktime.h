@@ -0,0 +1,32 @@
+#ifndef KTIME_H
+#define KTIME_H
+
+#include <stdint.h>
+
+#define PIT_HZ            1193182   // PIT input clock
+#define KTIME_CALIB_MS    10        // Length of one PIT calibration window
+#define KTIME_CALIB_RUNS  3         // Best of: an SMI or emulator hiccup only lengthens a run
+
+// Clocksource: the TSC, calibrated against PIT channel 2 at boot.
+// cycles -> ns is (cycles * mult) >> shift, with mult chosen to fit 32 bits.
+struct clocksource {
+	const char *name;
+	uint32_t khz;               // Counter frequency
+	uint32_t mult;
+	uint32_t shift;
+	uint64_t base;              // Counter value at ktime_init: time zero
+	int invariant;              // Constant rate across P/C-states (CPUID 0x80000007)
+	int calibrated;             // 0: the PIT never answered, khz is a guess
+};
+
+void ktime_init(void);
+// Cycles and nanoseconds since ktime_init; monotonic
+uint64_t ktime_cycles(void);
+uint64_t ktime_ns(void);
+uint64_t ktime_cycles_to_ns(uint64_t cycles);
+const struct clocksource *ktime_clocksource(void);
+
+// n / d without libgcc's 64-bit division; the remainder goes to *rem if not NULL
+uint64_t div_u64_rem(uint64_t n, uint32_t d, uint32_t *rem);
+
+#endif
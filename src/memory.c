@@ -2,19 +2,169 @@
 #include "pmm.h"
 #include "paging.h"
 #include "kheap.h"
+#include "vmem.h"
+#include "slab.h"
+#include "panic.h"
 // Removed user_mem.h - using vmalloc for user space
 #include "kprintf.h"
 
-void memory_init(uint32_t mem_bytes)
+#define MAX_PHYS_RANGES   32
+#define ZONE_ALIGN        0x00400000u               // Zones start on 4MB (one page table) boundaries
+#define FALLBACK_RAM_TOP  (10u * 1024u * 1024u)     // Used when the bootloader gives no memory info
+
+struct mem_layout mem_layout;
+
+static struct phys_range phys_ranges[MAX_PHYS_RANGES];
+static uint32_t phys_range_count = 0;
+
+static void add_phys_range(uint64_t base, uint64_t len, uint32_t type)
+{
+	// Anything above 4GB is out of reach without PAE
+	if (len == 0 || base >= 0x100000000ull) return;
+	uint64_t end = base + len;
+	if (end > 0xFFFFF000ull) end = 0xFFFFF000ull;
+	if (phys_range_count == MAX_PHYS_RANGES) {
+		kprintf("memory: too many memory map entries, ignoring %x\n", (uint32_t)base);
+		return;
+	}
+
+	// Keep the table sorted by base address
+	uint32_t i = phys_range_count++;
+	while (i > 0 && phys_ranges[i - 1].base > (uint32_t)base) {
+		phys_ranges[i] = phys_ranges[i - 1];
+		i--;
+	}
+	phys_ranges[i].base = (uint32_t)base;
+	phys_ranges[i].end = (uint32_t)end;
+	phys_ranges[i].type = type;
+}
+
+// Copy the bootloader memory map into phys_ranges; the multiboot structures
+// may live in RAM that the PMM is about to reuse.
+static void parse_memory_map(uint32_t magic, struct multiboot_info *mbi)
+{
+	if (magic != MULTIBOOT_MAGIC || !mbi) {
+		kprintf("memory: no multiboot info, assuming %d MB\n", FALLBACK_RAM_TOP / (1024 * 1024));
+		add_phys_range(PMM_START, FALLBACK_RAM_TOP - PMM_START, MULTIBOOT_MEMORY_AVAILABLE);
+		return;
+	}
+
+	if (mbi->flags & MULTIBOOT_INFO_MEM_MAP) {
+		uint32_t addr = mbi->mmap_addr;
+		uint32_t end = mbi->mmap_addr + mbi->mmap_length;
+		while (addr < end) {
+			struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry*)addr;
+			add_phys_range(e->addr, e->len, e->type);
+			addr += e->size + sizeof(e->size);
+		}
+	} else if (mbi->flags & MULTIBOOT_INFO_MEMORY) {
+		// mem_lower/mem_upper are in KB, mem_upper starts at 1MB
+		add_phys_range(0, (uint64_t)mbi->mem_lower * 1024, MULTIBOOT_MEMORY_AVAILABLE);
+		add_phys_range(PMM_START, (uint64_t)mbi->mem_upper * 1024, MULTIBOOT_MEMORY_AVAILABLE);
+	} else {
+		kprintf("memory: bootloader gave no memory info, assuming %d MB\n", FALLBACK_RAM_TOP / (1024 * 1024));
+		add_phys_range(PMM_START, FALLBACK_RAM_TOP - PMM_START, MULTIBOOT_MEMORY_AVAILABLE);
+	}
+
+	// Usable ranges must not overlap each other, or their frames would be freed twice
+	uint32_t covered = 0;
+	for (uint32_t i = 0; i < phys_range_count; i++) {
+		struct phys_range *r = &phys_ranges[i];
+		if (r->type != MULTIBOOT_MEMORY_AVAILABLE) continue;
+		if (r->base < covered) r->base = covered;
+		if (r->end < r->base) r->end = r->base;
+		covered = r->end;
+	}
+}
+
+static uint32_t align_zone(uint32_t addr)
+{
+	return (addr + ZONE_ALIGN - 1) & ~(ZONE_ALIGN - 1);
+}
+
+// Zone size: a fraction of RAM, clamped, rounded to whole pages
+static uint32_t zone_size(uint32_t ram_fraction, uint32_t min, uint32_t max)
 {
-	// Initialize physical memory manager with a cap
-	pmm_init(mem_bytes);
+	uint32_t size = ram_fraction;
+	if (size < min) size = min;
+	if (size > max) size = max;
+	return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static void memory_layout_init(void)
+{
+	uint32_t ram_top = 0;
+	uint32_t ram = 0;
+	for (uint32_t i = 0; i < phys_range_count; i++) {
+		if (phys_ranges[i].type != MULTIBOOT_MEMORY_AVAILABLE) continue;
+		ram += phys_ranges[i].end - phys_ranges[i].base;
+		if (phys_ranges[i].end > ram_top) ram_top = phys_ranges[i].end;
+	}
+	mem_layout.ram_bytes = ram;
+
+	// Identity map all of RAM up to DIRECT_MAP_LIMIT
+	mem_layout.direct_map_end = align_zone(ram_top);
+	if (mem_layout.direct_map_end > DIRECT_MAP_LIMIT || mem_layout.direct_map_end == 0)
+		mem_layout.direct_map_end = DIRECT_MAP_LIMIT;
+
+	// Kernel zone: heap and kernel vmalloc right above the direct map
+	mem_layout.kheap_start = mem_layout.direct_map_end;
+	mem_layout.kheap_end = mem_layout.kheap_start + zone_size(ram / 16, 0x00100000u, 0x04000000u);
+	mem_layout.kvmem_start = align_zone(mem_layout.kheap_end);
+	mem_layout.kvmem_end = mem_layout.kvmem_start + zone_size(ram / 4, 0x00300000u, 0x20000000u);
+
+	// User zone: vmalloc, then user processes
+	mem_layout.vmem_start = align_zone(mem_layout.kvmem_end);
+	mem_layout.vmem_end = mem_layout.vmem_start + zone_size(ram / 8, 0x00100000u, 0x10000000u);
+	mem_layout.user_start = align_zone(mem_layout.vmem_end);
+	mem_layout.user_end = mem_layout.user_start + zone_size(ram / 4, 0x00300000u, 0x40000000u);
+
+	mem_layout.scratch_start = align_zone(mem_layout.user_end);
+	mem_layout.scratch_end = mem_layout.scratch_start + ZONE_ALIGN;
+	if (mem_layout.scratch_end > KERNEL_FIXMAP_START) {
+		kpanic_fatal("memory layout overlaps the paging fixmap (%x)\n", mem_layout.scratch_end);
+	}
+}
+
+void memory_init(uint32_t magic, struct multiboot_info *mbi)
+{
+	parse_memory_map(magic, mbi);
+	memory_layout_init();
+
+	kprintf("Memory map (%d MB usable):\n", mem_layout.ram_bytes / (1024 * 1024));
+	for (uint32_t i = 0; i < phys_range_count; i++) {
+		kprintf("  %x - %x %s\n", phys_ranges[i].base, phys_ranges[i].end,
+		        phys_ranges[i].type == MULTIBOOT_MEMORY_AVAILABLE ? "usable" : "reserved");
+	}
+
+	// Initialize physical memory manager from the memory map
+	pmm_init(phys_ranges, phys_range_count, mem_layout.direct_map_end);
 	// Set up paging structures and enable paging
 	paging_init();
 	paging_enable();
 	// Initialize kernel heap
 	kheap_init();
+	slab_init();
+	vmem_init();
 	// User space uses vmalloc (virtual memory allocator)
 	kprintf("Memory subsystem initialized with vmalloc for user space.\n");
 }
 
+int kptr_owner(const void *addr, struct kptr_info *info)
+{
+	void *start;
+	if ((start = kmem_cache_obj(addr)) != 0) {
+		info->allocator = "kmalloc";
+		info->size = kmem_cache_of(addr)->size;
+	} else if ((start = kheap_owner(addr)) != 0) {
+		info->allocator = "kmalloc";
+		info->size = ksize(start);
+	} else if ((start = vmem_owner(addr)) != 0) {
+		info->allocator = "vmalloc";
+		info->size = vsize(start);
+	} else {
+		return -1;
+	}
+	info->start = start;
+	return 0;
+}
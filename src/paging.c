@@ -1,39 +1,95 @@
 #include "paging.h"
 #include "panic.h"
 #include "kprintf.h"
+#include "string.h"
 
-// Simple identity-mapped page directory + tables for first 10MB
+// Page directory; the identity map of the direct map region uses 4MB pages when the CPU has PSE.
+// Page tables are only ever accessed through the recursive slot, so they may come from highmem.
 static uint32_t __attribute__((aligned(4096))) page_directory[1024];
-static uint32_t __attribute__((aligned(4096))) page_tables[3][1024]; // 3 * 4MB = 12MB
+static int pse_enabled = 0;
 
 static inline void load_cr3(uint32_t phys) { asm volatile("mov %0, %%cr3" : : "r"(phys) : "memory"); }
 static inline uint32_t read_cr0(void) { uint32_t v; asm volatile("mov %%cr0, %0" : "=r"(v)); return v; }
 static inline void write_cr0(uint32_t v) { asm volatile("mov %0, %%cr0" : : "r"(v) : "memory"); }
+static inline uint32_t read_cr4(void) { uint32_t v; asm volatile("mov %%cr4, %0" : "=r"(v)); return v; }
+static inline void write_cr4(uint32_t v) { asm volatile("mov %0, %%cr4" : : "r"(v) : "memory"); }
 static inline void enable_wp(void) { uint32_t cr0 = read_cr0(); cr0 |= (1 << 16); write_cr0(cr0); }
 static inline void disable_wp(void) { uint32_t cr0 = read_cr0(); cr0 &= ~(1 << 16); write_cr0(cr0); }
+static inline void flush_tlb(void) { load_cr3((uint32_t)page_directory); }
+static inline void invlpg(uint32_t virt) { asm volatile("invlpg (%0)" : : "r"(virt) : "memory"); }
+
+// Invalidations collected by a bulk operation, issued once at the end.
+// Past TLB_BATCH_MAX entries a single CR3 reload is cheaper than the invlpgs.
+struct tlb_batch {
+	uint32_t count;
+	uint32_t addr[TLB_BATCH_MAX];
+};
+
+static void tlb_batch_add(struct tlb_batch *batch, uint32_t virt)
+{
+	if (batch->count < TLB_BATCH_MAX) batch->addr[batch->count] = virt;
+	batch->count++;
+}
+
+static void tlb_batch_flush(struct tlb_batch *batch)
+{
+	if (batch->count > TLB_BATCH_MAX) {
+		flush_tlb();
+	} else {
+		for (uint32_t i = 0; i < batch->count; i++) invlpg(batch->addr[i]);
+	}
+	batch->count = 0;
+}
+
+static int cpu_has_pse(void)
+{
+	uint32_t eax = 1, ebx, ecx, edx;
+	asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+	return (edx >> 3) & 1;
+}
 
 void paging_init(void)
 {
-	// 0x00000000 - 0x00BFFFFF: Virtual = Physical (identity mapped)
-	// 0x00C000000+: Virtual ≠ Physical (non-identity mapped)
+	// 0x00000000 - DIRECT_MAP_END: Virtual = Physical (identity mapped)
+	// DIRECT_MAP_END+: Virtual ≠ Physical (kheap, vmalloc, user zones)
 	// Zero PD
 	for (int i = 0; i < 1024; i++) page_directory[i] = 0;
-	// Identity-map first ~12MB using present|write
+	if (cpu_has_pse()) {
+		write_cr4(read_cr4() | CR4_PSE);
+		pse_enabled = 1;
+	}
+	// Identity-map the direct map using present|write
 	// Map kernel code/data but not BIOS data area
-	for (int t = 0; t < 3; t++) {
+	uint32_t tables = DIRECT_MAP_END >> 22;
+	for (uint32_t t = 0; t < tables; t++) {
+		if (pse_enabled) {
+			// DIRECT_MAP_END is 4MB aligned, so the whole direct map fits in large pages
+			page_directory[t] = (t << 22) | PAGE_PRESENT | PAGE_WRITE | PAGE_LARGE;
+			continue;
+		}
+		// Paging is still off, so the new table is written through its physical address
+		uint32_t *table = (uint32_t*)pmm_alloc_page();
+		pmm_set_page_type(table, PG_PAGETABLE);
 		for (int i = 0; i < 1024; i++) {
 			uint32_t phys = (t * 1024 + i) * PAGE_SIZE;
 			// Map everything for now - we'll handle BIOS protection in page fault handler
-			page_tables[t][i] = (phys & 0xFFFFF000) | PAGE_PRESENT | PAGE_WRITE;
+			table[i] = (phys & 0xFFFFF000) | PAGE_PRESENT | PAGE_WRITE;
 		}
-		page_directory[t] = ((uint32_t)page_tables[t]) | PAGE_PRESENT | PAGE_WRITE; // supervisor RW
+		page_directory[t] = ((uint32_t)table) | PAGE_PRESENT | PAGE_WRITE; // supervisor RW
 	}
-	// Kernel space/user space notion: addresses >= 0xC0000000 can later be kernel
-	// For now, we only identity map low memory.
+	// Table for the kmap window, and the recursive slot (supervisor only)
+	uint32_t *fixmap = (uint32_t*)pmm_alloc_page();
+	pmm_set_page_type(fixmap, PG_PAGETABLE);
+	for (int i = 0; i < 1024; i++) fixmap[i] = 0;
+	page_directory[KMAP_WINDOW >> 22] = (uint32_t)fixmap | PAGE_PRESENT | PAGE_WRITE;
+	page_directory[PD_RECURSIVE_SLOT] = (uint32_t)page_directory | PAGE_PRESENT | PAGE_WRITE;
+	setup_page_fault_handler();
+	// Kernel space/user space notion: addresses >= USER_ZONE_START are user zone
 	load_cr3((uint32_t)page_directory);
 	// Enable write protection
 	enable_wp();
-	kprintf("Paging structures initialized.\n");
+	kprintf("Paging structures initialized (identity map up to %x, %s pages).\n",
+	        DIRECT_MAP_END, pse_enabled ? "4MB" : "4KB");
 }
 
 void paging_enable(void)
@@ -44,57 +100,573 @@ void paging_enable(void)
 	kprintf("Paging enabled.\n");
 }
 
+int vmm_large_pages_enabled(void)
+{
+	return pse_enabled;
+}
+
+// Map any frame at KMAP_WINDOW; the caller keeps interrupts off until kunmap_frame()
+static uint32_t *kmap_frame(uint32_t phys)
+{
+	uint32_t *pte = &PT_VIRT(KMAP_WINDOW >> 22)[(KMAP_WINDOW >> 12) & 0x3FF];
+	*pte = (phys & 0xFFFFF000) | PAGE_PRESENT | PAGE_WRITE;
+	invlpg(KMAP_WINDOW);
+	return (uint32_t*)KMAP_WINDOW;
+}
+
+static void kunmap_frame(void)
+{
+	PT_VIRT(KMAP_WINDOW >> 22)[(KMAP_WINDOW >> 12) & 0x3FF] = 0;
+	invlpg(KMAP_WINDOW);
+}
+
+// Frame for a new page table: a pre-zeroed one if the pool has it, otherwise
+// any frame (highmem first), which the caller fills through the kmap window
+static uint32_t alloc_table_frame(int *zeroed)
+{
+	void *frame = pmm_zero_pool_get();
+	*zeroed = frame != NULL;
+	if (!frame) frame = pmm_alloc_highmem_pages(0);
+	if (!frame) return 0;
+	pmm_set_page_type(frame, PG_PAGETABLE);
+	return (uint32_t)frame;
+}
+
+// Point PDE pd_idx at a table, and drop whatever the recursive window cached for it
+static void install_table(uint32_t pd_idx, uint32_t entry)
+{
+	page_directory[pd_idx] = entry;
+	invlpg((uint32_t)PT_VIRT(pd_idx));
+}
+
+int vmm_split_large_page(uint32_t virt)
+{
+	uint32_t pd_idx = (virt >> 22) & 0x3FF;
+	uint32_t pde = page_directory[pd_idx];
+	if (!(pde & PAGE_PRESENT) || !(pde & PAGE_LARGE)) return -1;
+	// Same frames and rights, one PTE per 4KB. The table has to be complete before it
+	// is installed: the large page may well be mapping the code doing the split.
+	int zeroed;
+	uint32_t table_phys = alloc_table_frame(&zeroed);
+	if (!table_phys) return -1;
+	uint32_t base = pde & 0xFFC00000;
+	uint32_t flags = pde & 0xFFF & ~PAGE_LARGE;
+	uint32_t irq = irq_save();
+	uint32_t *table = kmap_frame(table_phys);
+	for (uint32_t i = 0; i < 1024; i++) {
+		table[i] = (base + i * PAGE_SIZE) | flags;
+	}
+	kunmap_frame();
+	irq_restore(irq);
+	install_table(pd_idx, table_phys | flags);
+	// The large TLB entry must go before the 4KB ones are used
+	flush_tlb();
+	return 0;
+}
+
+int vmm_collapse_large_page(uint32_t virt)
+{
+	uint32_t pd_idx = (virt >> 22) & 0x3FF;
+	uint32_t pde = page_directory[pd_idx];
+	if (!pse_enabled || !(pde & PAGE_PRESENT) || (pde & PAGE_LARGE)) return -1;
+	// Only a table mapping one aligned 4MB frame run with uniform rights can be collapsed
+	uint32_t *table = PT_VIRT(pd_idx);
+	uint32_t base = table[0] & 0xFFFFF000;
+	uint32_t flags = table[0] & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER);
+	if (base & 0x3FFFFF) return -1;
+	for (uint32_t i = 0; i < 1024; i++) {
+		if (table[i] != ((base + i * PAGE_SIZE) | (table[i] & 0xFFF)) ||
+		    (table[i] & (PAGE_PRESENT | PAGE_WRITE | PAGE_USER)) != flags) return -1;
+	}
+	if (!(flags & PAGE_PRESENT)) return -1;
+	page_directory[pd_idx] = base | flags | PAGE_LARGE;
+	flush_tlb();
+	pmm_free_page((void*)(pde & 0xFFFFF000));
+	return 0;
+}
+
 uint32_t *virt_to_pte(uint32_t virt, int create)
 {
 	uint32_t pd_idx = (virt >> 22) & 0x3FF;
 	uint32_t pt_idx = (virt >> 12) & 0x3FF;
+	if (pd_idx == PD_RECURSIVE_SLOT) return NULL;
 	uint32_t pde = page_directory[pd_idx];
+	if ((pde & PAGE_PRESENT) && (pde & PAGE_LARGE)) {
+		// Callers want a PTE, so a 4KB mapping is needed inside the large page
+		if (vmm_split_large_page(virt) != 0) kpanic_fatal("virt_to_pte: cannot split large page at %x\n", virt);
+		pde = page_directory[pd_idx];
+	}
 	if (!(pde & PAGE_PRESENT)) {
 		if (!create) return NULL;
-		// allocate a new table
-		uint32_t *new_table = (uint32_t*)pmm_alloc_page();
-		for (int i = 0; i < 1024; i++) new_table[i] = 0;
-		page_directory[pd_idx] = ((uint32_t)new_table) | PAGE_PRESENT | PAGE_WRITE | ((virt >= USER_ZONE_START) ? PAGE_USER : 0);
-		pde = page_directory[pd_idx];
+		// allocate a new table, cleared by the zero pool or through the kmap window
+		int zeroed;
+		uint32_t table_phys = alloc_table_frame(&zeroed);
+		if (!table_phys) kpanic_fatal("virt_to_pte: out of memory for page table\n");
+		if (!zeroed) {
+			uint32_t irq = irq_save();
+			memset(kmap_frame(table_phys), 0, PAGE_SIZE);
+			kunmap_frame();
+			irq_restore(irq);
+		}
+		install_table(pd_idx, table_phys | PAGE_PRESENT | PAGE_WRITE | ((virt >= USER_ZONE_START) ? PAGE_USER : 0));
 	}
-	uint32_t *pt = (uint32_t*)(pde & 0xFFFFF000);
-	return &pt[pt_idx];
+	return &PT_VIRT(pd_idx)[pt_idx];
 }
 
-int vmm_map_page(uint32_t virt, uint32_t phys, uint32_t flags)
+// Write a PTE; only a previously present entry can be cached in the TLB
+static int set_pte(uint32_t virt, uint32_t entry, struct tlb_batch *batch)
 {
-	uint32_t *pte = virt_to_pte(virt, 1);
-	if (!pte) return -1;
-	*pte = (phys & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT;
+	uint32_t *pte = virt_to_pte(virt, entry != 0);
+	if (!pte) return entry ? -1 : 0;
+	uint32_t old = *pte;
+	*pte = entry;
+	if ((old & PAGE_PRESENT) && old != entry) tlb_batch_add(batch, virt);
 	return 0;
 }
 
+int vmm_map_page(uint32_t virt, uint32_t phys, uint32_t flags)
+{
+	struct tlb_batch batch = { 0 };
+	int ret = set_pte(virt, (phys & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT, &batch);
+	tlb_batch_flush(&batch);
+	return ret;
+}
+
 void vmm_unmap_page(uint32_t virt)
 {
-	uint32_t *pte = virt_to_pte(virt, 0);
-	if (!pte) return;
-	*pte = 0;
+	struct tlb_batch batch = { 0 };
+	set_pte(virt, 0, &batch);
+	tlb_batch_flush(&batch);
+}
+
+int vmm_map_range(uint32_t virt, uint32_t phys, uint32_t npages, uint32_t flags)
+{
+	struct tlb_batch batch = { 0 };
+	int ret = 0;
+	for (uint32_t i = 0; i < npages && ret == 0; i++) {
+		ret = set_pte(virt + i * PAGE_SIZE, ((phys + i * PAGE_SIZE) & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT, &batch);
+	}
+	tlb_batch_flush(&batch);
+	return ret;
+}
+
+int vmm_map_frames(uint32_t virt, void *const *frames, uint32_t npages, uint32_t flags)
+{
+	struct tlb_batch batch = { 0 };
+	int ret = 0;
+	for (uint32_t i = 0; i < npages && ret == 0; i++) {
+		ret = set_pte(virt + i * PAGE_SIZE, ((uint32_t)frames[i] & 0xFFFFF000) | (flags & 0xFFF) | PAGE_PRESENT, &batch);
+	}
+	tlb_batch_flush(&batch);
+	return ret;
+}
+
+static void unmap_range(uint32_t virt, uint32_t npages, struct tlb_batch *batch)
+{
+	uint32_t end = virt + npages * PAGE_SIZE;
+	while (virt < end) {
+		// Nothing to clear under an empty PDE
+		if (!(page_directory[virt >> 22] & PAGE_PRESENT)) {
+			uint32_t next = (virt & 0xFFC00000) + 0x00400000;
+			if (next <= virt || next >= end) break;
+			virt = next;
+			continue;
+		}
+		set_pte(virt, 0, batch);
+		virt += PAGE_SIZE;
+	}
+}
+
+void vmm_unmap_range(uint32_t virt, uint32_t npages)
+{
+	struct tlb_batch batch = { 0 };
+	unmap_range(virt, npages, &batch);
+	tlb_batch_flush(&batch);
+}
+
+void vmm_unmap_range_noflush(uint32_t virt, uint32_t npages)
+{
+	struct tlb_batch batch = { 0 };
+	unmap_range(virt, npages, &batch);
 }
 
 uint32_t vmm_get_mapping(uint32_t virt)
 {
+	uint32_t pde = page_directory[(virt >> 22) & 0x3FF];
+	if ((pde & PAGE_PRESENT) && (pde & PAGE_LARGE)) {
+		// Report the 4KB frame inside the large page, keeping PAGE_LARGE as a marker
+		return (pde & 0xFFC00000) + (virt & 0x3FF000) + (pde & 0xFFF);
+	}
 	uint32_t *pte = virt_to_pte(virt, 0);
 	if (!pte) return 0;
 	return *pte;
 }
 
-// Page fault handler - handles permission violations and missing pages
-void page_fault_handler(void)
+int vmm_map_new_pages(uint32_t virt, uint32_t npages, uint32_t flags, uint32_t type)
+{
+	struct tlb_batch batch = { 0 };
+	int ret = 0;
+	int large = (flags & PAGE_LARGE) && pse_enabled;
+	flags &= ~PAGE_LARGE;
+	while (npages > 0) {
+		// Whole aligned 4MB steps go in a single PDE when a 4MB block is available
+		if (large && !(virt & 0x3FFFFF) && npages >= 1024 && !(page_directory[virt >> 22] & PAGE_PRESENT)) {
+			void *big = pmm_alloc_highmem_pages(PMM_MAX_ORDER);
+			if (big) {
+				pmm_set_page_type(big, type);
+				pmm_split_pages(big, PMM_MAX_ORDER);
+				page_directory[virt >> 22] = (uint32_t)big | (flags & 0xFFF) | PAGE_PRESENT | PAGE_LARGE;
+				virt += 1024 * PAGE_SIZE;
+				npages -= 1024;
+				continue;
+			}
+		}
+
+		// Largest buddy order that still fits in what is left to map
+		uint32_t order = 0;
+		while (order < PMM_MAX_ORDER && (2u << order) <= npages) order++;
+
+		void *block = pmm_alloc_highmem_pages(order);
+		while (!block && order > 0) {
+			order--;
+			block = pmm_alloc_highmem_pages(order);
+		}
+		if (!block) {
+			ret = -1;
+			break;
+		}
+
+		// Pages are unmapped and freed individually later on
+		pmm_set_page_type(block, type);
+		pmm_split_pages(block, order);
+		uint32_t i;
+		for (i = 0; i < (1u << order); i++) {
+			if (set_pte(virt, ((uint32_t)block + i * PAGE_SIZE) | (flags & 0xFFF) | PAGE_PRESENT, &batch) != 0) break;
+			virt += PAGE_SIZE;
+		}
+		if (i < (1u << order)) {
+			// No page table for the rest: its frames go straight back, the caller
+			// unmaps what was mapped
+			for (; i < (1u << order); i++) pmm_free_page((void*)((uint32_t)block + i * PAGE_SIZE));
+			ret = -1;
+			break;
+		}
+		npages -= 1u << order;
+	}
+	tlb_batch_flush(&batch);
+	return ret;
+}
+
+// One pre-zeroed frame behind every untouched page of the zero-filled lazy regions.
+// It is pinned: it holds its allocation reference forever and mappings of it take
+// none. struct page's 16-bit refcount could not count them (a sparse vmalloc zone
+// alone can map it 131072 times), and the regions' zero_pages counters already
+// track the mappings.
+static uint32_t zero_frame = 0;
+
+// Frames are freed before the batch is flushed; nothing touches the range in between.
+// Returns the private frames released; zero page mappings are counted in *zero.
+static uint32_t release_range(uint32_t virt, uint32_t npages, struct tlb_batch *batch, uint32_t *zero)
+{
+	uint32_t end = virt + npages * PAGE_SIZE;
+	uint32_t released = 0;
+	while (virt < end) {
+		uint32_t pd_idx = virt >> 22;
+		uint32_t pde = page_directory[pd_idx];
+		if (!(pde & PAGE_PRESENT)) {
+			uint32_t next = (virt & 0xFFC00000) + 0x00400000;
+			if (next <= virt) break;
+			virt = next;
+			continue;
+		}
+		if ((pde & PAGE_LARGE) && !(virt & 0x3FFFFF) && end - virt >= 0x00400000) {
+			// A whole 4MB page: drop the PDE, its frames were split into single pages
+			page_directory[pd_idx] = 0;
+			tlb_batch_add(batch, virt);
+			for (uint32_t i = 0; i < 1024; i++) pmm_free_page((void*)((pde & 0xFFC00000) + i * PAGE_SIZE));
+			released += 1024;
+			virt += 0x00400000;
+			continue;
+		}
+		uint32_t entry = vmm_get_mapping(virt);
+		if (entry & PAGE_PRESENT) {
+			set_pte(virt, 0, batch);
+			if (!(entry & PAGE_COW)) {
+				pmm_free_page((void*)(entry & 0xFFFFF000));
+				released++;
+			} else if (zero) {
+				// Only the zero page is mapped copy-on-write, and it is never freed
+				(*zero)++;
+			}
+		}
+		virt += PAGE_SIZE;
+	}
+	return released;
+}
+
+uint32_t vmm_release_range(uint32_t virt, uint32_t npages)
+{
+	struct tlb_batch batch = { 0 };
+	uint32_t released = release_range(virt, npages, &batch, NULL);
+	tlb_batch_flush(&batch);
+	return released;
+}
+
+void vmm_flush_tlb(void)
+{
+	flush_tlb();
+}
+
+int vmm_map_zeroed_pages(uint32_t virt, uint32_t npages, uint32_t flags, uint32_t type)
+{
+	struct tlb_batch batch = { 0 };
+	int ret = 0;
+	for (uint32_t i = 0; i < npages && ret == 0; i++, virt += PAGE_SIZE) {
+		void *frame = pmm_zero_pool_get();
+		if (frame) {
+			pmm_set_page_type(frame, type);
+			ret = set_pte(virt, (uint32_t)frame | (flags & 0xFFF) | PAGE_PRESENT, &batch);
+			continue;
+		}
+		// Pool is empty: take any frame (highmem first) and clear it through its new mapping
+		ret = vmm_map_new_pages(virt, 1, flags, type);
+		if (ret == 0) memset((void*)virt, 0, PAGE_SIZE);
+	}
+	tlb_batch_flush(&batch);
+	return ret;
+}
+
+// Kernel VA regions and how they are backed
+static struct vm_region regions[VM_REGION_MAX];
+static uint32_t region_count = 0;
+
+// Fault handling statistics
+static uint32_t cow_fault_count = 0;
+static uint32_t fault_count = 0;
+static uint64_t fault_cycles = 0;
+static uint32_t fault_max_cycles = 0;
+
+static struct vm_region *find_region(uint32_t addr)
+{
+	for (uint32_t i = 0; i < region_count; i++) {
+		if (addr >= regions[i].start && addr < regions[i].end) return &regions[i];
+	}
+	return NULL;
+}
+
+// Back every unmapped page of [start, end) inside the region
+static int region_populate(struct vm_region *r, uint32_t start, uint32_t end)
+{
+	uint32_t v = start;
+	while (v < end) {
+		if (vmm_get_mapping(v) & PAGE_PRESENT) {
+			v += PAGE_SIZE;
+			continue;
+		}
+		uint32_t run = v;
+		while (run < end && !(vmm_get_mapping(run) & PAGE_PRESENT)) run += PAGE_SIZE;
+		uint32_t n = (run - v) / PAGE_SIZE;
+		int ret = (r->policy & VM_ZERO) ? vmm_map_zeroed_pages(v, n, r->flags & ~PAGE_LARGE, r->type)
+		                                : vmm_map_new_pages(v, n, r->flags, r->type);
+		if (ret != 0) return -1;
+		r->pages += n;
+		v = run;
+	}
+	return 0;
+}
+
+// Unmap [virt, virt + npages pages) and keep the region's counters in step
+static uint32_t region_release(struct vm_region *r, uint32_t virt, uint32_t npages, int flush)
+{
+	struct tlb_batch batch = { 0 };
+	uint32_t zero = 0;
+	uint32_t released = release_range(virt, npages, &batch, &zero);
+	if (flush) tlb_batch_flush(&batch);
+	if (r) {
+		r->pages -= released;
+		r->zero_pages -= zero;
+	}
+	return released;
+}
+
+int vmm_region_add(const char *name, uint32_t start, uint32_t end, uint32_t flags,
+                   uint32_t type, uint32_t policy, uint32_t fault_around)
+{
+	if (region_count >= VM_REGION_MAX || (start & (PAGE_SIZE - 1)) || end < start) return -1;
+	// The fault-around window is aligned on its own size
+	if (fault_around == 0 || (fault_around & (fault_around - 1))) fault_around = 1;
+	struct vm_region *r = &regions[region_count++];
+	r->name = name;
+	r->start = start;
+	r->end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	r->flags = flags;
+	r->type = type;
+	r->policy = policy;
+	r->fault_around = fault_around;
+	r->faults = 0;
+	r->pages = 0;
+	r->zero_pages = 0;
+	r->extent = NULL;
+	if ((policy & VM_POLICY_MASK) == VM_EAGER) return region_populate(r, r->start, r->end);
+	return 0;
+}
+
+int vmm_region_set_end(uint32_t start, uint32_t end)
 {
+	for (uint32_t i = 0; i < region_count; i++) {
+		if (regions[i].start != start) continue;
+		struct vm_region *r = &regions[i];
+		uint32_t old_end = r->end;
+		uint32_t new_end = (end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		if (new_end < r->start) return -1;
+		r->end = new_end;
+		if (new_end < old_end) {
+			// Shrinking gives the frames past the new end back to the PMM
+			region_release(r, new_end, (old_end - new_end) / PAGE_SIZE, 1);
+		} else if ((r->policy & VM_POLICY_MASK) == VM_EAGER && new_end > old_end) {
+			uint32_t pages = r->pages;
+			if (region_populate(r, old_end, new_end) != 0) {
+				// Out of frames: undo the partial growth. A failed run may have mapped
+				// pages it never counted, so the count is restored, not decremented.
+				r->end = old_end;
+				vmm_release_range(old_end, (new_end - old_end) / PAGE_SIZE);
+				r->pages = pages;
+				return -1;
+			}
+		}
+		return 0;
+	}
+	return -1;
+}
+
+int vmm_region_set_extent(uint32_t start, int (*extent)(uint32_t addr, uint32_t *start, uint32_t *end))
+{
+	for (uint32_t i = 0; i < region_count; i++) {
+		if (regions[i].start != start) continue;
+		regions[i].extent = extent;
+		return 0;
+	}
+	return -1;
+}
+
+uint32_t vmm_region_release(uint32_t virt, uint32_t npages)
+{
+	return region_release(find_region(virt), virt, npages, 1);
+}
+
+uint32_t vmm_region_release_noflush(uint32_t virt, uint32_t npages)
+{
+	return region_release(find_region(virt), virt, npages, 0);
+}
+
+const struct vm_region *vmm_region_get(uint32_t index)
+{
+	return index < region_count ? &regions[index] : NULL;
+}
+
+void vmm_fault_stats(uint32_t *count, uint64_t *cycles, uint32_t *max_cycles)
+{
+	*count = fault_count;
+	*cycles = fault_cycles;
+	*max_cycles = fault_max_cycles;
+}
+
+uint32_t vmm_cow_faults(void)
+{
+	return cow_fault_count;
+}
+
+// Map every unmapped page of [start, end) read-only to the zero page
+static int region_map_zero(struct vm_region *r, uint32_t start, uint32_t end)
+{
+	if (!zero_frame) {
+		void *frame = pmm_alloc_zeroed_page();
+		if (!frame) return -1;
+		zero_frame = (uint32_t)frame;
+	}
+	// Nothing was present, so there is nothing to invalidate
+	struct tlb_batch batch = { 0 };
+	uint32_t entry = zero_frame | (r->flags & 0xFFF & ~(PAGE_WRITE | PAGE_LARGE)) | PAGE_COW | PAGE_PRESENT;
+	for (uint32_t v = start; v < end; v += PAGE_SIZE) {
+		if (vmm_get_mapping(v) & PAGE_PRESENT) continue;
+		if (set_pte(v, entry, &batch) != 0) return -1;
+		r->zero_pages++;
+	}
+	return 0;
+}
+
+// Not-present fault inside a lazy region: map the fault-around window, clipped to
+// the allocation when the region tracks them. Returns 1 for an unallocated address.
+// Zero-filled regions only spend a frame on the page being written; the rest of
+// the window shares the zero page until its first store.
+static int region_fault(struct vm_region *r, uint32_t addr, int write)
+{
+	uint32_t lo = r->start, hi = r->end;
+	if (r->extent && r->extent(addr, &lo, &hi) != 0) return 1;
+	uint32_t window = r->fault_around * PAGE_SIZE;
+	uint32_t start = addr & ~(window - 1);
+	uint32_t end = start + window;
+	if (start < lo) start = lo;
+	if (end > hi || end < start) end = hi;
+	r->faults++;
+	if (!(r->policy & VM_ZERO)) return region_populate(r, start, end);
+	if (write) {
+		uint32_t page = addr & ~(PAGE_SIZE - 1);
+		if (region_populate(r, page, page + PAGE_SIZE) != 0) return -1;
+	}
+	return region_map_zero(r, start, end);
+}
+
+// Write to a present read-only page of a lazy region: a zero page mapping gets a
+// private zeroed frame. Returns 1 outside the allocations, 2 if the page is not
+// a zero page mapping (a real protection fault).
+static int cow_fault(struct vm_region *r, uint32_t addr)
+{
+	uint32_t lo, hi;
+	if (r->extent && r->extent(addr, &lo, &hi) != 0) return 1;
+	uint32_t page = addr & ~(PAGE_SIZE - 1);
+	uint32_t entry = vmm_get_mapping(page);
+	if (!(entry & PAGE_COW) || (entry & 0xFFFFF000) != zero_frame) return 2;
+
+	// Replaces the read-only mapping, invalidating it
+	if (vmm_map_zeroed_pages(page, 1, r->flags & 0xFFF & ~PAGE_LARGE, r->type) != 0) return -1;
+	r->zero_pages--;
+	r->pages++;
+	cow_fault_count++;
+	return 0;
+}
+
+// Page fault handler - handles demand paging, permission violations and missing pages
+void page_fault_handler(struct regs *r, void *ctx __attribute__((unused)))
+{
+	uint32_t error_code = r->error;
 	uint32_t fault_addr;
-	uint32_t error_code;
 	
 	// Get fault address from CR2 register
 	asm volatile("mov %%cr2, %0" : "=r"(fault_addr));
 	
-	// Get error code from stack (pushed by CPU before our wrapper)
-	// The error code is at offset 28 from ESP (7 registers * 4 bytes = 28)
-	asm volatile("mov 28(%%esp), %0" : "=r"(error_code));
+	// Kernel touching a lazily backed region for the first time, or writing to a
+	// page that still shares a frame
+	int present = error_code & PF_PRESENT;
+	if (!(error_code & PF_USER) && (!present || (error_code & PF_WRITE))) {
+		struct vm_region *r = find_region(fault_addr);
+		if (r && (r->policy & VM_POLICY_MASK) == VM_LAZY) {
+			uint64_t t0 = rdtsc();
+			int ret = present ? cow_fault(r, fault_addr) : region_fault(r, fault_addr, error_code & PF_WRITE);
+			if (ret < 0) {
+				kpanic_fatal("Page fault: out of memory backing %x (%s)\n", fault_addr, r->name);
+			}
+			if (ret == 0) {
+				uint32_t cycles = (uint32_t)(rdtsc() - t0);
+				fault_count++;
+				fault_cycles += cycles;
+				if (cycles > fault_max_cycles) fault_max_cycles = cycles;
+				return;
+			}
+			// Freed block or guard page
+			if (ret == 1) kpanic_fatal("Page fault: %x is not allocated in %s\n", fault_addr, r->name);
+		}
+	}
 	
 	// Check if trying to access BIOS addresses (0x00000000-0x000FFFFF)
 	if (fault_addr < 0x00100000) {
@@ -102,14 +674,14 @@ void page_fault_handler(void)
 	}
 	
 	// Check if it's a permission violation (user trying to access kernel space)
-	if ((error_code & 0x4) && (fault_addr < USER_ZONE_START)) {
+	if ((error_code & PF_USER) && (fault_addr < USER_ZONE_START)) {
 		kpanic_fatal("User access to kernel space denied\n");
 	}
 	
 	// Check if it's a user space permission violation
-	if ((error_code & 0x4) && (fault_addr >= USER_ZONE_START)) {
-		uint32_t *pte = virt_to_pte(fault_addr, 0);
-		if (pte && (*pte & PAGE_PRESENT)) {
+	if ((error_code & PF_USER) && (fault_addr >= USER_ZONE_START)) {
+		uint32_t pte = vmm_get_mapping(fault_addr);
+		if (pte & PAGE_PRESENT) {
 			kpanic_fatal("User access to supervisor-only page denied\n");
 		}
 	}
@@ -120,8 +692,7 @@ void page_fault_handler(void)
 
 void setup_page_fault_handler(void)
 {
-	// Set up page fault handler in IDT (interrupt 14)
-	// This will be called by the interrupt system
+	irq_register(14, page_fault_handler, NULL);
 	kprintf("Page fault handler registered (interrupt 14)\n");
 }
 
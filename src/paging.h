@@ -4,20 +4,113 @@
 #include <stdint.h>
 #include <stddef.h>
 #include "pmm.h"
+#include "irq.h"
 
 #define PAGE_PRESENT   0x001
 #define PAGE_WRITE     0x002
 #define PAGE_USER      0x004
+#define PAGE_WRITETHROUGH 0x008 // PWT: write-through caching
+#define PAGE_NOCACHE   0x010   // PCD: uncached, for device registers
+#define PAGE_LARGE     0x080   // PS bit: a PDE mapping 4MB directly
+#define PAGE_COW       0x200   // Available bit: read-only zero page mapping, replaced on the first write
+
+#define CR4_PSE        0x010
+
+// PD[1023] points back at the page directory, so the page table of PDE i is always
+// visible at PT_VIRT_BASE + i * PAGE_SIZE, wherever its frame lives in RAM
+#define PD_RECURSIVE_SLOT 1023
+#define PT_VIRT_BASE   0xFFC00000u
+#define PD_VIRT        0xFFFFF000u
+#define PT_VIRT(pd_idx) ((uint32_t*)(PT_VIRT_BASE + (pd_idx) * PAGE_SIZE))
+// One-page window used to fill page tables before they are installed (table under PD[1022])
+#define KMAP_WINDOW    0xFFBFF000u
+
+// Above this many pending invlpgs a bulk operation reloads CR3 instead
+#define TLB_BATCH_MAX  32
 
 typedef uint32_t page_entry_t;
 
 void paging_init(void);
 void paging_enable(void);
 
-// Map/unmap single page
+// Map/unmap single page, invalidating the old translation if there was one
 int  vmm_map_page(uint32_t virt, uint32_t phys, uint32_t flags);
 void vmm_unmap_page(uint32_t virt);
+// Inside a 4MB page the result is the matching 4KB slice, with PAGE_LARGE set
 uint32_t vmm_get_mapping(uint32_t virt);
+// Bulk versions: map npages contiguous frames from phys on, or clear a range.
+// TLB invalidations are batched and issued once at the end.
+int  vmm_map_range(uint32_t virt, uint32_t phys, uint32_t npages, uint32_t flags);
+void vmm_unmap_range(uint32_t virt, uint32_t npages);
+// Map npages frames given one by one, e.g. scattered frames into a contiguous window
+int  vmm_map_frames(uint32_t virt, void *const *frames, uint32_t npages, uint32_t flags);
+// vmm_unmap_range without the invalidations; the caller ends with vmm_flush_tlb()
+void vmm_unmap_range_noflush(uint32_t virt, uint32_t npages);
+// Back [virt, virt + npages * PAGE_SIZE) with fresh frames of the given PG_* type,
+// taken from the PMM in the largest runs available. With PAGE_LARGE in flags,
+// 4MB-aligned stretches are mapped with 4MB pages when the CPU supports them.
+int  vmm_map_new_pages(uint32_t virt, uint32_t npages, uint32_t flags, uint32_t type);
+
+// Unmap a range and give its frames back to the PMM; returns the number of pages freed
+uint32_t vmm_release_range(uint32_t virt, uint32_t npages);
+// Drop every non-global TLB entry (one CR3 reload)
+void vmm_flush_tlb(void);
+// Same as vmm_map_new_pages, with zero-filled frames: taken from the PMM zero pool when possible.
+// The range must be mapped writable.
+int  vmm_map_zeroed_pages(uint32_t virt, uint32_t npages, uint32_t flags, uint32_t type);
+
+// 4MB pages: split one into a page table (done on demand by virt_to_pte), or fold
+// a table that maps one aligned 4MB run back into a large page
+int  vmm_large_pages_enabled(void);
+int  vmm_split_large_page(uint32_t virt);
+int  vmm_collapse_large_page(uint32_t virt);
+
+// Page fault error code bits
+#define PF_PRESENT     0x001   // Protection violation (clear: page not present)
+#define PF_WRITE       0x002
+#define PF_USER        0x004
+
+// Kernel VA regions with a backing policy. Lazy regions are populated by the
+// page fault handler on first touch, fault_around pages (a power of two) at a time.
+#define VM_REGION_MAX  16
+#define VM_EAGER       0x000   // Backed when the region is added or grown
+#define VM_LAZY        0x001   // Backed on first touch
+#define VM_POLICY_MASK 0x0FF
+#define VM_ZERO        0x100   // Fresh pages are zero-filled
+
+struct vm_region {
+	const char *name;
+	uint32_t start;
+	uint32_t end;           // Exclusive
+	uint32_t flags;         // PTE flags; PAGE_LARGE allowed
+	uint32_t type;          // PG_* type of the backing frames
+	uint32_t policy;
+	uint32_t fault_around;
+	uint32_t faults;        // Faults resolved in this region
+	uint32_t pages;         // Pages backed so far
+	uint32_t zero_pages;    // Pages mapped to the shared zero page (VM_ZERO lazy regions)
+	// Optional: bounds [*start, *end) of the allocation around addr, nonzero if
+	// addr is not allocated. Faults outside allocations are not backed.
+	int (*extent)(uint32_t addr, uint32_t *start, uint32_t *end);
+};
+
+int  vmm_region_add(const char *name, uint32_t start, uint32_t end, uint32_t flags,
+                    uint32_t type, uint32_t policy, uint32_t fault_around);
+// Move the end of the region starting at `start` (heaps that grow with a break).
+// Growing an eager region maps the new pages; shrinking releases the frames past the end.
+int  vmm_region_set_end(uint32_t start, uint32_t end);
+int  vmm_region_set_extent(uint32_t start, int (*extent)(uint32_t addr, uint32_t *start, uint32_t *end));
+// Unmap pages of a region and give their frames back; returns how many were backed
+uint32_t vmm_region_release(uint32_t virt, uint32_t npages);
+// Same, leaving stale TLB entries behind: the caller batches several releases
+// and must call vmm_flush_tlb() before the range or its frames are reused
+uint32_t vmm_region_release_noflush(uint32_t virt, uint32_t npages);
+const struct vm_region *vmm_region_get(uint32_t index);
+void vmm_fault_stats(uint32_t *count, uint64_t *cycles, uint32_t *max_cycles);
+// Writes that gave a zero page mapping its own frame
+uint32_t vmm_cow_faults(void);
+void page_fault_handler(struct regs *r, void *ctx);
+void setup_page_fault_handler(void);
 
 // Internal paging functions
 uint32_t *virt_to_pte(uint32_t virt, int create);
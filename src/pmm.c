@@ -1,94 +1,560 @@
 #include "pmm.h"
 #include "panic.h"
 #include "kprintf.h"
+#include "string.h"
 
-#define PMM_START 0x00100000u
+// End of the kernel image, from link.ld
+extern uint8_t _kernel_end[];
 
-static uint32_t total_pages = 0;
+static uint32_t total_pages = 0;   // Usable RAM frames reported by the bootloader
 static uint32_t free_pages = 0;
-static uint32_t pmm_limit_bytes = 0;
-
-// Bitmap: 1 = used, 0 = free
-// Allocate maximum possible bitmap (1GB / 4KB / 32 bits per uint32_t)
-static uint32_t bitmap[(PMM_MAX_BYTES / PAGE_SIZE) / 32 + 1];
-
-static inline void set_bit(uint32_t idx) { bitmap[idx >> 5] |= (1u << (idx & 31)); }
-static inline void clr_bit(uint32_t idx) { bitmap[idx >> 5] &= ~(1u << (idx & 31)); }
-static inline int  tst_bit(uint32_t idx) { return (bitmap[idx >> 5] >> (idx & 31)) & 1u; }
-
-void pmm_init(uint32_t mem_size_bytes)
-{
-	// Cap memory at maximum supported size
-	if (mem_size_bytes > PMM_MAX_BYTES) {
-		kprintf("PMM: Memory size %d MB exceeds maximum %d MB, capping\n", 
-		        mem_size_bytes / (1024 * 1024), PMM_MAX_BYTES / (1024 * 1024));
-		mem_size_bytes = PMM_MAX_BYTES;
-	}
-	
-	pmm_limit_bytes = mem_size_bytes;
-    
-    // Calculate how much memory is actually available (after PMM_START)
-    uint32_t available_memory = mem_size_bytes - PMM_START;
-    uint32_t available_pages = available_memory / PAGE_SIZE;
-    
-    if (available_pages == 0) {
-        kpanic_fatal("PMM: no memory available after PMM_START\n");
-    }
-    
-    // total_pages should be based on available memory, not total memory
-    total_pages = available_pages;
-    
+static uint32_t max_pfn = 0;       // Frames [0, max_pfn) have a struct page
+
+// Page frame database, carved out of RAM right after the kernel image by pmm_init().
+// Only the head frame of a buddy block carries its order, type and refcount;
+// interior frames and reserved frames have flags == 0.
+struct page *mem_map;
+
+// Frames of each type, for the pmminfo breakdown
+static uint32_t type_pages[PG_NR_TYPES];
+
+// Each zone has its own free lists, so that frames with a scarce property
+// (ISA DMA reach, a direct mapping) are only spent on callers that need it.
+// Zone boundaries are 4MB aligned, so no buddy block ever straddles two zones.
+struct zone {
+	const char *name;
+	uint32_t start_pfn;
+	uint32_t end_pfn;
+	struct page *head[PMM_MAX_ORDER + 1];
+	uint32_t blocks[PMM_MAX_ORDER + 1];
+	uint32_t total;
+};
+
+static struct zone zones[ZONE_COUNT] = {
+	[ZONE_DMA] = { .name = "DMA" },
+	[ZONE_NORMAL] = { .name = "Normal" },
+	[ZONE_HIGHMEM] = { .name = "HighMem" },
+};
+
+// Free DMA pages that only DMA-capable requests may use
+static uint32_t dma_reserve = 0;
+
+// Pre-zeroed order-0 frames, linked through struct page
+static struct page *zero_pool;
+static uint32_t zero_pool_count;
+static uint32_t zero_pool_hits;
+static uint32_t zero_pool_misses;
+
+static inline struct zone *zone_of(uint32_t pfn)
+{
+	if (pfn < zones[ZONE_DMA].end_pfn) return &zones[ZONE_DMA];
+	if (pfn < zones[ZONE_NORMAL].end_pfn) return &zones[ZONE_NORMAL];
+	return &zones[ZONE_HIGHMEM];
+}
+
+static uint32_t zone_free_pages(const struct zone *zone)
+{
+	uint32_t free = 0;
+	for (uint32_t o = 0; o <= PMM_MAX_ORDER; o++) free += zone->blocks[o] << o;
+	return free;
+}
+static inline void *pfn_to_addr(uint32_t pfn) { return (void*)(pfn * PAGE_SIZE); }
+
+static inline int is_free_head(struct page *page, uint32_t order)
+{
+	return page->flags == (PG_HEAD | PG_FREE) && page->order == order;
+}
+
+static void free_list_push(uint32_t pfn, uint32_t order)
+{
+	// Blocks are indexed by physical pfn, so a 2^order block starts on a 2^order
+	// frame boundary; pmm_alloc_contig's alignment and 4MB PSE pages rely on it
+	if (pfn & ((1u << order) - 1)) kpanic_fatal("PMM: misaligned order-%d block at pfn %x\n", order, pfn);
+	struct zone *area = zone_of(pfn);
+	struct page *page = pfn_to_page(pfn);
+	page->prev = NULL;
+	page->next = area->head[order];
+	if (area->head[order]) area->head[order]->prev = page;
+	area->head[order] = page;
+	page->flags = PG_HEAD | PG_FREE;
+	page->order = order;
+	page->refcount = 0;
+	area->blocks[order]++;
+}
+
+static void free_list_remove(uint32_t pfn, uint32_t order)
+{
+	struct zone *area = zone_of(pfn);
+	struct page *page = pfn_to_page(pfn);
+	if (page->prev) page->prev->next = page->next;
+	else area->head[order] = page->next;
+	if (page->next) page->next->prev = page->prev;
+	page->next = page->prev = NULL;
+	page->flags = 0;
+	area->blocks[order]--;
+}
+
+// Push the frames [start, end) to the buddy lists as the largest aligned blocks.
+// Blocks are pushed from the top down so that low addresses are handed out first.
+static void push_range(uint32_t start, uint32_t end)
+{
+	while (end > start) {
+		uint32_t order = 0;
+		while (order < PMM_MAX_ORDER) {
+			uint32_t size = 1u << (order + 1);
+			if ((end & (size - 1)) || end - start < size) break;
+			order++;
+		}
+		end -= 1u << order;
+		free_list_push(end, order);
+		free_pages += 1u << order;
+	}
+}
+
+// Hand never-used frames [start, end) to the zones they belong to
+static void free_range(uint32_t start, uint32_t end)
+{
+	for (uint32_t z = 0; z < ZONE_COUNT; z++) {
+		uint32_t s = start > zones[z].start_pfn ? start : zones[z].start_pfn;
+		uint32_t e = end < zones[z].end_pfn ? end : zones[z].end_pfn;
+		if (s >= e) continue;
+		zones[z].total += e - s;
+		push_range(s, e);
+	}
+}
+
+// Free [start, end) minus every reserved range from index `from` on
+static void free_available(uint32_t start, uint32_t end, const struct phys_range *ranges, uint32_t count, uint32_t from)
+{
+	for (uint32_t i = from; i < count; i++) {
+		if (ranges[i].type == MULTIBOOT_MEMORY_AVAILABLE) continue;
+		uint32_t hole_start = ranges[i].base / PAGE_SIZE;
+		uint32_t hole_end = (ranges[i].end + PAGE_SIZE - 1) / PAGE_SIZE;
+		if (hole_end <= start || hole_start >= end) continue;
+		if (hole_start > start) free_available(start, hole_start, ranges, count, i + 1);
+		if (hole_end < end) free_available(hole_end, end, ranges, count, i + 1);
+		return;
+	}
+	if (end > start) free_range(start, end);
+}
+
+static void zone_init(struct zone *zone, uint32_t start_pfn, uint32_t end_pfn)
+{
+	if (end_pfn < start_pfn) end_pfn = start_pfn;
+	zone->start_pfn = start_pfn;
+	zone->end_pfn = end_pfn;
+	for (uint32_t o = 0; o <= PMM_MAX_ORDER; o++) {
+		zone->head[o] = NULL;
+		zone->blocks[o] = 0;
+	}
+	zone->total = 0;
+}
+
+void pmm_init(const struct phys_range *ranges, uint32_t count, uint32_t direct_map_end)
+{
+	// Size the metadata for the highest usable frame
+	total_pages = 0;
+	max_pfn = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (ranges[i].type != MULTIBOOT_MEMORY_AVAILABLE) continue;
+		uint32_t first = (ranges[i].base + PAGE_SIZE - 1) / PAGE_SIZE;
+		uint32_t last = ranges[i].end / PAGE_SIZE;
+		if (last <= first) continue;
+		total_pages += last - first;
+		if (last > max_pfn) max_pfn = last;
+	}
+	if (max_pfn == 0) {
+		kpanic_fatal("PMM: no usable memory reported\n");
+	}
+
+	// Place the metadata right after the kernel image; it has to sit in usable lowmem
+	uint32_t meta_start = ((uint32_t)_kernel_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uint32_t meta_end = meta_start + max_pfn * sizeof(struct page);
+	meta_end = (meta_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	int placed = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (ranges[i].type == MULTIBOOT_MEMORY_AVAILABLE &&
+		    ranges[i].base <= meta_start && meta_end <= ranges[i].end) placed = 1;
+	}
+	if (!placed || meta_end > direct_map_end) {
+		kpanic_fatal("PMM: no room for frame metadata at %x-%x\n", meta_start, meta_end);
+	}
+	mem_map = (struct page*)meta_start;
+	for (uint32_t i = 0; i < max_pfn; i++) {
+		mem_map[i].refcount = 0;
+		mem_map[i].flags = 0;
+		mem_map[i].order = 0;
+		mem_map[i].next = mem_map[i].prev = NULL;
+	}
+	for (uint32_t t = 0; t < PG_NR_TYPES; t++) {
+		type_pages[t] = 0;
+	}
+
 	free_pages = 0;
-	// Initialize bitmap: mark all as used initially
-	for (uint32_t i = 0; i < (sizeof(bitmap)/sizeof(bitmap[0])); i++) {
-		bitmap[i] = 0xFFFFFFFFu;
-	}
-	
-	// Mark available pages as free starting from PMM_START
-	uint32_t start_page = 0; // index 0 corresponds to PMM_START
-	for (uint32_t i = start_page; i < available_pages; i++) {
-		clr_bit(i);
-		free_pages++;
-	}
-	
-	// Reserve first few pages for kernel (roughly 1MB for now)
-	uint32_t reserve_pages = (1024u * 1024u) / PAGE_SIZE;
-	if (reserve_pages > available_pages) reserve_pages = available_pages;
-	for (uint32_t i = 0; i < reserve_pages; i++) {
-		if (!tst_bit(i)) { set_bit(i); free_pages--; }
-	}
-	
-	kprintf("PMM: total=%d pages (%d MB), free=%d pages (%d MB)\n", 
+	zero_pool = NULL;
+	zero_pool_count = zero_pool_hits = zero_pool_misses = 0;
+	uint32_t dma_end = PMM_DMA_LIMIT / PAGE_SIZE;
+	uint32_t normal_end = direct_map_end / PAGE_SIZE;
+	if (dma_end > normal_end) dma_end = normal_end;
+	zone_init(&zones[ZONE_DMA], 0, dma_end);
+	zone_init(&zones[ZONE_NORMAL], dma_end, normal_end);
+	zone_init(&zones[ZONE_HIGHMEM], normal_end, max_pfn);
+
+	// BIOS area, kernel image and metadata stay reserved; so do holes and non-RAM ranges
+	uint32_t first_free = meta_end / PAGE_SIZE;
+	for (uint32_t i = 0; i < count; i++) {
+		if (ranges[i].type != MULTIBOOT_MEMORY_AVAILABLE) continue;
+		uint32_t first = (ranges[i].base + PAGE_SIZE - 1) / PAGE_SIZE;
+		uint32_t last = ranges[i].end / PAGE_SIZE;
+		if (first < first_free) first = first_free;
+		if (last > first) free_available(first, last, ranges, count, 0);
+	}
+	type_pages[PG_FREE] = free_pages;
+
+	// Keep a quarter of the DMA zone (up to 1MB) for drivers, unless it is all the RAM there is
+	dma_reserve = 0;
+	if (zones[ZONE_NORMAL].total + zones[ZONE_HIGHMEM].total > 0) {
+		dma_reserve = zones[ZONE_DMA].total / 4;
+		if (dma_reserve > PMM_DMA_RESERVE) dma_reserve = PMM_DMA_RESERVE;
+	}
+
+	kprintf("PMM: total=%d pages (%d MB), free=%d pages (%d MB)\n",
 	        total_pages, total_pages * PAGE_SIZE / (1024 * 1024),
 	        free_pages, free_pages * PAGE_SIZE / (1024 * 1024));
+	kprintf("PMM: DMA %d KB, Normal %d MB, HighMem %d MB, metadata %x-%x\n",
+	        zones[ZONE_DMA].total * 4, zones[ZONE_NORMAL].total / 256,
+	        zones[ZONE_HIGHMEM].total / 256, meta_start, meta_end);
 }
 
-void *pmm_alloc_page(void)
+static void *area_alloc(struct zone *area, uint32_t order)
+{
+	// Find the smallest non-empty order that can satisfy the request
+	uint32_t o = order;
+	while (o <= PMM_MAX_ORDER && !area->head[o]) o++;
+	if (o > PMM_MAX_ORDER) return NULL;
+
+	uint32_t pfn = page_to_pfn(area->head[o]);
+	free_list_remove(pfn, o);
+
+	// Split down, returning the upper halves to their free lists
+	while (o > order) {
+		o--;
+		free_list_push(pfn + (1u << o), o);
+	}
+
+	struct page *page = pfn_to_page(pfn);
+	page->flags = PG_HEAD | PG_KERNEL;
+	page->order = order;
+	page->refcount = 1;
+	free_pages -= 1u << order;
+	type_pages[PG_FREE] -= 1u << order;
+	type_pages[PG_KERNEL] += 1u << order;
+	return pfn_to_addr(pfn);
+}
+
+// Take a frame out of the zero pool; it becomes an allocated PG_KERNEL page
+static void *zero_pool_pop(void)
+{
+	struct page *page = zero_pool;
+	if (!page) return NULL;
+	zero_pool = page->next;
+	zero_pool_count--;
+	page->next = NULL;
+	page->flags = PG_HEAD | PG_KERNEL;
+	page->order = 0;
+	page->refcount = 1;
+	free_pages--;
+	type_pages[PG_FREE]--;
+	type_pages[PG_KERNEL]++;
+	return pfn_to_addr(page_to_pfn(page));
+}
+
+// Last resort for non-DMA requests: the DMA zone, as long as it stays above its reserve
+static void *dma_fallback(uint32_t order)
+{
+	if (zone_free_pages(&zones[ZONE_DMA]) < dma_reserve + (1u << order)) return NULL;
+	return area_alloc(&zones[ZONE_DMA], order);
+}
+
+void *pmm_alloc_pages(uint32_t order)
+{
+	if (order > PMM_MAX_ORDER) return NULL;
+	void *block = area_alloc(&zones[ZONE_NORMAL], order);
+	// Zeroed frames are still free memory, just more expensive to hand out
+	if (!block && order == 0) block = zero_pool_pop();
+	if (!block) block = dma_fallback(order);
+	return block;
+}
+
+void *pmm_alloc_highmem_pages(uint32_t order)
 {
-	for (uint32_t i = 0; i < total_pages; i++) {
-		if (!tst_bit(i)) {
-			set_bit(i);
-			free_pages--;
-			return (void*)(PMM_START + i * PAGE_SIZE);
+	if (order > PMM_MAX_ORDER) return NULL;
+	void *block = area_alloc(&zones[ZONE_HIGHMEM], order);
+	if (!block) block = pmm_alloc_pages(order);
+	return block;
+}
+
+void *pmm_alloc_dma_pages(uint32_t order)
+{
+	if (order > PMM_MAX_ORDER) return NULL;
+	return area_alloc(&zones[ZONE_DMA], order);
+}
+
+// Find a free block of at least `order` that ends below limit_pfn and carve a
+// 2^order block out of it. Returns its frame number, or 0 (never a usable frame).
+static uint32_t take_block_below(struct zone *zone, uint32_t order, uint32_t limit_pfn)
+{
+	for (uint32_t o = order; o <= PMM_MAX_ORDER; o++) {
+		for (struct page *page = zone->head[o]; page; page = page->next) {
+			uint32_t pfn = page_to_pfn(page);
+			if (pfn + (1u << order) > limit_pfn) continue;
+			free_list_remove(pfn, o);
+			// Split down, keeping the low half so the block stays under the limit
+			while (o > order) {
+				o--;
+				free_list_push(pfn + (1u << o), o);
+			}
+			return pfn;
 		}
 	}
-	kpanic_fatal("PMM out of memory\n");
-	return NULL;
+	return 0;
 }
 
-void pmm_free_page(void *page)
+void *pmm_alloc_contig(uint32_t npages, uint32_t align, uint32_t max_phys)
 {
-	uint32_t addr = (uint32_t)page;
-	if (addr < PMM_START) return; // ignore
-	uint32_t idx = (addr - PMM_START) / PAGE_SIZE;
-	if (idx >= total_pages) return;
-    if (!tst_bit(idx)) { kpanic_fatal("PMM: double free page %x\n", (uint32_t)addr); return; }
-	clr_bit(idx);
+	if (npages == 0 || align > (PAGE_SIZE << PMM_MAX_ORDER) || (align & (align - 1))) return NULL;
+
+	// Buddy blocks are naturally aligned, so a block big enough for both size and alignment works
+	uint32_t order = 0;
+	while ((1u << order) < npages || ((uint32_t)PAGE_SIZE << order) < align) {
+		if (++order > PMM_MAX_ORDER) return NULL;
+	}
+
+	// max_phys is inclusive: the frame holding it is still allowed (0xFFFFFFFF gives 0x100000)
+	uint32_t limit_pfn = max_phys / PAGE_SIZE + 1;
+
+	// Prefer the zones nobody else is short of, highest first
+	uint32_t pfn = 0;
+	for (int z = ZONE_COUNT - 1; z >= 0 && !pfn; z--) {
+		if (zones[z].start_pfn >= limit_pfn) continue;
+		// Requests that could be served elsewhere leave the DMA reserve alone
+		if (z == ZONE_DMA && limit_pfn > zones[z].end_pfn &&
+		    zone_free_pages(&zones[z]) < dma_reserve + (1u << order)) continue;
+		pfn = take_block_below(&zones[z], order, limit_pfn);
+	}
+	if (!pfn) return NULL;
+
+	// Hand out the first npages as single pages and return the tail
+	for (uint32_t i = 0; i < npages; i++) {
+		struct page *page = pfn_to_page(pfn + i);
+		page->flags = PG_HEAD | PG_KERNEL;
+		page->order = 0;
+		page->refcount = 1;
+	}
+	free_pages -= 1u << order;
+	push_range(pfn + npages, pfn + (1u << order));
+	type_pages[PG_FREE] -= npages;
+	type_pages[PG_KERNEL] += npages;
+	return pfn_to_addr(pfn);
+}
+
+void pmm_free_contig(void *ptr, uint32_t npages)
+{
+	for (uint32_t i = 0; i < npages; i++) {
+		pmm_free_page((uint8_t*)ptr + i * PAGE_SIZE);
+	}
+}
+
+void *pmm_zero_pool_get(void)
+{
+	uint32_t flags = irq_save();
+	void *page = zero_pool_pop();
+	if (page) zero_pool_hits++;
+	else zero_pool_misses++;
+	irq_restore(flags);
+	return page;
+}
+
+void *pmm_alloc_zeroed_page(void)
+{
+	void *page = pmm_zero_pool_get();
+	if (page) return page;
+	page = pmm_alloc_pages(0);
+	if (page) memset(page, 0, PAGE_SIZE);
+	return page;
+}
+
+int pmm_zero_pool_refill(void)
+{
+	// Only direct-mapped frames can be cleared; keep the DMA zone for drivers
+	uint32_t flags = irq_save();
+	void *frame = NULL;
+	if (zero_pool_count < PMM_ZERO_POOL_TARGET) frame = area_alloc(&zones[ZONE_NORMAL], 0);
+	irq_restore(flags);
+	if (!frame) return 0;
+
+	// The frame belongs to nobody while it is being cleared, so interrupts can stay on
+	memset(frame, 0, PAGE_SIZE);
+
+	flags = irq_save();
+	struct page *page = pfn_to_page((uint32_t)frame / PAGE_SIZE);
+	page->flags = PG_HEAD | PG_FREE | PG_ZEROED;
+	page->refcount = 0;
+	page->prev = NULL;
+	page->next = zero_pool;
+	zero_pool = page;
+	zero_pool_count++;
 	free_pages++;
+	type_pages[PG_KERNEL]--;
+	type_pages[PG_FREE]++;
+	irq_restore(flags);
+	return 1;
 }
 
-uint32_t pmm_free_pages(void) { return free_pages; }
+uint32_t pmm_zero_pool_count(void) { return zero_pool_count; }
+uint32_t pmm_zero_pool_hits(void) { return zero_pool_hits; }
+uint32_t pmm_zero_pool_misses(void) { return zero_pool_misses; }
+
+// Head page of an allocated block, or NULL if ptr is not one
+static struct page *allocated_head(void *ptr)
+{
+	uint32_t pfn = (uint32_t)ptr / PAGE_SIZE;
+	if ((uint32_t)ptr & (PAGE_SIZE - 1) || pfn >= max_pfn) return NULL;
+	struct page *page = pfn_to_page(pfn);
+	if (!(page->flags & PG_HEAD) || PG_TYPE(page) == PG_FREE || page->refcount == 0) return NULL;
+	return page;
+}
+
+void pmm_free_pages(void *ptr, uint32_t order)
+{
+	uint32_t addr = (uint32_t)ptr;
+	if (addr < PMM_START) return; // ignore
+	uint32_t pfn = addr / PAGE_SIZE;
+	if (pfn >= max_pfn) return;
+	struct page *page = allocated_head(ptr);
+	if (!page || page->order != order) {
+		kpanic_fatal("PMM: double free or invalid free of page %x (order %d)\n", addr, (int)order);
+		return;
+	}
+	// Shared frames stay allocated until the last reference is dropped
+	if (--page->refcount > 0) return;
+
+	free_pages += 1u << order;
+	type_pages[PG_TYPE(page)] -= 1u << order;
+	type_pages[PG_FREE] += 1u << order;
+	page->flags = 0;
+
+	// Merge with the buddy for as long as it is a free block of the same order
+	while (order < PMM_MAX_ORDER) {
+		uint32_t buddy = pfn ^ (1u << order);
+		if (buddy >= max_pfn || !is_free_head(pfn_to_page(buddy), order)) break;
+		free_list_remove(buddy, order);
+		if (buddy < pfn) pfn = buddy;
+		order++;
+	}
+	free_list_push(pfn, order);
+}
+
+void pmm_split_pages(void *ptr, uint32_t order)
+{
+	struct page *page = allocated_head(ptr);
+	if (!page || page->order != order) {
+		kpanic_fatal("PMM: split of unallocated block %x (order %d)\n", (uint32_t)ptr, (int)order);
+		return;
+	}
+	for (uint32_t i = 1; i < (1u << order); i++) {
+		page[i].flags = page->flags;
+		page[i].order = 0;
+		page[i].refcount = page->refcount;
+	}
+	page->order = 0;
+}
+
+void pmm_get_page(void *page)
+{
+	struct page *head = allocated_head(page);
+	if (!head) {
+		kpanic_fatal("PMM: reference to unallocated page %x\n", (uint32_t)page);
+		return;
+	}
+	head->refcount++;
+}
+
+uint32_t pmm_page_refcount(void *page)
+{
+	struct page *head = allocated_head(page);
+	return head ? head->refcount : 0;
+}
+
+void pmm_set_page_type(void *ptr, uint32_t type)
+{
+	struct page *page = allocated_head(ptr);
+	if (!page || type == PG_FREE || type >= PG_NR_TYPES) {
+		kpanic_fatal("PMM: cannot retype page %x\n", (uint32_t)ptr);
+		return;
+	}
+	type_pages[PG_TYPE(page)] -= 1u << page->order;
+	type_pages[type] += 1u << page->order;
+	page->flags = (page->flags & ~PG_TYPE_MASK) | type;
+}
+
+void *pmm_alloc_page(void)
+{
+	void *page = pmm_alloc_pages(0);
+	if (!page) kpanic_fatal("PMM out of memory\n");
+	return page;
+}
+
+void pmm_free_page(void *page)
+{
+	pmm_free_pages(page, 0);
+}
+
+struct page *pmm_direct_page(const void *addr)
+{
+	uint32_t pfn = (uint32_t)addr / PAGE_SIZE;
+	if (pfn >= max_pfn || pfn >= zones[ZONE_NORMAL].end_pfn) return NULL;
+	return pfn_to_page(pfn);
+}
+
+uint32_t pmm_free_page_count(void) { return free_pages; }
 uint32_t pmm_total_pages(void) { return total_pages; }
+uint32_t pmm_highmem_pages(void) { return zones[ZONE_HIGHMEM].total; }
+
+const char *pmm_zone_name(uint32_t zone)
+{
+	return zone < ZONE_COUNT ? zones[zone].name : "?";
+}
+
+uint32_t pmm_zone_total_pages(uint32_t zone)
+{
+	return zone < ZONE_COUNT ? zones[zone].total : 0;
+}
+
+uint32_t pmm_zone_free_pages(uint32_t zone)
+{
+	return zone < ZONE_COUNT ? zone_free_pages(&zones[zone]) : 0;
+}
+
+uint32_t pmm_free_blocks(uint32_t order)
+{
+	if (order > PMM_MAX_ORDER) return 0;
+	uint32_t blocks = 0;
+	for (uint32_t z = 0; z < ZONE_COUNT; z++) blocks += zones[z].blocks[order];
+	return blocks;
+}
+
+uint32_t pmm_type_pages(uint32_t type)
+{
+	if (type >= PG_NR_TYPES) return 0;
+	if (type == PG_RESERVED) {
+		// Everything usable that the allocator never got: kernel image, metadata, BIOS area
+		uint32_t accounted = 0;
+		for (uint32_t t = PG_FREE; t < PG_NR_TYPES; t++) accounted += type_pages[t];
+		return total_pages - accounted;
+	}
+	return type_pages[type];
+}
 
 // Physical memory break - simple implementation
 static void *current_brk = 0;
@@ -102,18 +568,17 @@ void *pmm_brk(void *new_brk)
 		}
 		return current_brk;
 	}
-	
+
 	// Simple implementation: just track the break point
 	// In a real OS, this would manage a physical heap
 	uint32_t new_addr = (uint32_t)new_brk;
 	uint32_t start_addr = PMM_START;
-	uint32_t max_addr = PMM_START + total_pages * PAGE_SIZE;
-	
+	uint32_t max_addr = max_pfn * PAGE_SIZE;
+
 	if (new_addr < start_addr || new_addr > max_addr) {
 		return (void*)-1; // Invalid break
 	}
-	
+
 	current_brk = new_brk;
 	return current_brk;
 }
-
@@ -6,14 +6,108 @@
 #include <stddef.h>
 
 #define PAGE_SIZE 4096
-#define PMM_START 0x00100000u
-#define PMM_MAX_BYTES (10u * 1024u * 1024u)  // 10MB maximum
+#define PMM_START 0x00100000u                // Nothing below 1MB is handed out
+#define PMM_MAX_ORDER 10                     // Largest buddy block: 2^10 pages (4MB)
+#define PMM_DMA_LIMIT 0x01000000u            // ISA DMA can only reach the first 16MB
+#define PMM_DMA_RESERVE 256                  // Max DMA pages kept back from normal allocations
 
-void pmm_init(uint32_t mem_size_bytes);
+// Physical memory zones
+enum {
+	ZONE_DMA,        // Below PMM_DMA_LIMIT
+	ZONE_NORMAL,     // Rest of the direct map
+	ZONE_HIGHMEM,    // Above the direct map
+	ZONE_COUNT
+};
+
+// A physical address range reported by the bootloader, clipped to 32 bits
+struct phys_range {
+	uint32_t base;
+	uint32_t end;       // Exclusive
+	uint32_t type;      // MULTIBOOT_MEMORY_AVAILABLE or a reserved type
+};
+
+// Per-frame descriptor. next/prev link the block into its buddy free list while
+// it is free; nothing uses them once it is allocated.
+struct page {
+	uint16_t refcount;
+	uint8_t flags;      // Type in the low nibble, state bits above
+	uint8_t order;      // Buddy order, valid on PG_HEAD frames
+	struct page *next;
+	struct page *prev;
+};
+
+// Page types
+#define PG_RESERVED  0      // Never handed to the allocator (BIOS, kernel image, holes)
+#define PG_FREE      1
+#define PG_KERNEL    2      // Default for pmm_alloc_pages()
+#define PG_HEAP      3
+#define PG_PAGETABLE 4
+#define PG_VMALLOC   5
+#define PG_SLAB      6      // Every frame of a slab carries it, with the slab order
+#define PG_ARENA     7      // Arena chunks
+#define PG_NR_TYPES  8
+#define PG_TYPE_MASK 0x0F
+// State bits
+#define PG_HEAD      0x10   // First frame of a buddy block, free or allocated
+#define PG_ZEROED    0x40   // Free frame parked in the zero pool
+
+#define PG_TYPE(page) ((page)->flags & PG_TYPE_MASK)
+
+extern struct page *mem_map;
+
+static inline struct page *pfn_to_page(uint32_t pfn) { return &mem_map[pfn]; }
+static inline uint32_t page_to_pfn(const struct page *page) { return (uint32_t)(page - mem_map); }
+// Descriptor of the frame behind a direct-map address, NULL outside the direct map
+struct page *pmm_direct_page(const void *addr);
+
+// Frames below direct_map_end are lowmem (identity mapped), the rest is highmem
+void pmm_init(const struct phys_range *ranges, uint32_t count, uint32_t direct_map_end);
 void *pmm_alloc_page(void);
 void pmm_free_page(void *page);
-uint32_t pmm_free_pages(void);
+
+// Buddy allocator: physically contiguous, naturally aligned runs of 2^order pages.
+// pmm_alloc_pages returns NULL when no block of that order is left. It takes from
+// ZONE_NORMAL and only falls back to ZONE_DMA above the DMA reserve.
+void *pmm_alloc_pages(uint32_t order);
+void pmm_free_pages(void *ptr, uint32_t order);
+// Same, but prefers highmem: the frames may lie outside the direct map and must be mapped before use
+void *pmm_alloc_highmem_pages(uint32_t order);
+// Blocks from ZONE_DMA only
+void *pmm_alloc_dma_pages(uint32_t order);
+// npages contiguous pages, aligned on `align` (a power of two, at most 4MB) and ending
+// at or below max_phys (0xFFFFFFFF for no limit). The block may lie in highmem unless
+// max_phys says otherwise. Pages can be freed together or one by one.
+void *pmm_alloc_contig(uint32_t npages, uint32_t align, uint32_t max_phys);
+void pmm_free_contig(void *ptr, uint32_t npages);
+// Turn an allocated 2^order block into 2^order single pages that can be freed one by one
+void pmm_split_pages(void *ptr, uint32_t order);
+
+// Zero pool: lowmem frames cleared ahead of time by the idle loop.
+// pmm_alloc_zeroed_page takes from the pool and only clears a frame itself on a miss;
+// it returns NULL when out of memory. Pool frames still count as free.
+#define PMM_ZERO_POOL_TARGET 256
+void *pmm_alloc_zeroed_page(void);
+void *pmm_zero_pool_get(void);       // Pool only: NULL on a miss
+int pmm_zero_pool_refill(void);      // Clear one more frame; 0 once the pool is full
+uint32_t pmm_zero_pool_count(void);
+uint32_t pmm_zero_pool_hits(void);
+uint32_t pmm_zero_pool_misses(void);
+
+// Reference counting: pages start with one reference, and pmm_free_page(s) only
+// releases the frames once the last reference is dropped.
+void pmm_get_page(void *page);
+uint32_t pmm_page_refcount(void *page);
+// Retag an allocated block (PG_HEAP, PG_PAGETABLE, ...) for the per-type accounting
+void pmm_set_page_type(void *ptr, uint32_t type);
+
+uint32_t pmm_free_page_count(void);
 uint32_t pmm_total_pages(void);
+uint32_t pmm_highmem_pages(void);
+uint32_t pmm_free_blocks(uint32_t order);
+const char *pmm_zone_name(uint32_t zone);
+uint32_t pmm_zone_total_pages(uint32_t zone);
+uint32_t pmm_zone_free_pages(uint32_t zone);
+uint32_t pmm_type_pages(uint32_t type);
 void *pmm_brk(void *new_brk);
 
 #endif
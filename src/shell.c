@@ -6,7 +6,14 @@
 #include "kheap.h"
 #include "paging.h"
 #include "vmem.h"
+#include "slab.h"
+#include "allocprof.h"
+#include "arena.h"
 #include "panic.h"
+#include "ktime.h"
+#include "timer.h"
+#include "irq.h"
+#include "keyboard.h"
 
 #ifndef NULL
 #define NULL ((void*)0)
@@ -15,7 +22,8 @@
 // Shell state
 static char shell_buffer[SHELL_BUFFER_SIZE];
 static size_t shell_buffer_pos = 0;
-static uint32_t boot_time = 0;
+// Scratch memory for the running command, dropped when it returns
+static struct arena *cmd_arena = NULL;
 
 // Command table
 static struct shell_command commands[] = {
@@ -27,6 +35,10 @@ static struct shell_command commands[] = {
     {"gdt", "Display GDT information", cmd_gdt_info},
     {"version", "Display kernel version", cmd_version},
     {"shutdown", "Shutdown system gracefully", cmd_shutdown},
+    {"uptime", "Time since boot and the clocksource", cmd_uptime},
+    {"timertest", "Check timer wheel expiry, cascading, msleep and timeouts", cmd_timertest},
+    {"idlestat", "Idle residency, wakeups per second and skipped ticks", cmd_idlestat},
+    {"irqstat", "Hits and handler latency per interrupt vector", cmd_irqstat},
     {"meminfo", "Show memory stats", cmd_meminfo},
     {"kmalloc", "Allocate kernel memory: kmalloc <bytes>", cmd_kmalloc},
     {"kfree", "Free kernel memory: kfree <addr>", cmd_kfree},
@@ -41,6 +53,8 @@ static struct shell_command commands[] = {
     {"pageops", "Test page creation and management", cmd_page_ops},
     {"kmalloctest", "Test allocation functions (kmalloc, kfree, ksize)", cmd_kmalloc_test},
     {"vmalloctest", "Test allocation functions (vmalloc, vfree, vsize)", cmd_vmalloc_test},
+    {"vmaptest", "Map scattered frames and the VGA buffer with vmap/ioremap", cmd_vmaptest},
+    {"cowtest", "Read a sparse vmalloc buffer through the zero page, then write to it", cmd_cowtest},
     {"ktest", "Allocate, write, verify, free: ktest <bytes> <value>", cmd_ktest},
     {"vtest", "Allocate, write, verify, free: vtest <bytes> <value>", cmd_vtest},
     {"write", "Write int to any allocator addr: write <addr> <value>", cmd_write},
@@ -48,15 +62,21 @@ static struct shell_command commands[] = {
     {"rotest", "Test read-only page protection", cmd_rotest},
     {"pftest", "Test page fault handler by accessing invalid memory", cmd_pftest},
     {"pftest2", "Simple page fault test - access unmapped memory", cmd_pftest2},
+    {"slabinfo", "Show slab cache utilisation", cmd_slabinfo},
+    {"arenatest", "Time arena bump allocation against kmalloc/kfree", cmd_arenatest},
+    {"heapprof", "Allocation profile: heapprof [top_n|reset]", cmd_heapprof},
+    {"pfstat", "Show demand paging regions and fault statistics", cmd_pfstat},
+    {"tlbbench", "Compare page walks over 4MB and 4KB pages", cmd_tlbbench},
     {"panictest", "Test kernel panic handling", cmd_panic_test},
     {NULL, NULL, NULL} // Sentinel
 };
 
 void shell_init(void)
 {
-    boot_time = 0; // We'll implement a timer later
     shell_buffer_pos = 0;
     memset(shell_buffer, 0, SHELL_BUFFER_SIZE);
+    cmd_arena = arena_create(SHELL_ARENA_SIZE);
+    if (!cmd_arena) kpanic_fatal("shell_init: no memory for the command arena\n");
     
     kprintf("KFS Debug Shell v1.0\n");
     kprintf("Type 'help' for available commands.\n\n");
@@ -106,6 +126,7 @@ void shell_execute_command(const char *command_line)
         if (strcmp(argv[0], commands[i].name) == 0) {
             kprintf("Executing command: %s\n", commands[i].name);
             commands[i].function(argc, argv);
+            arena_reset(cmd_arena);
             return;
         }
     }
@@ -114,6 +135,11 @@ void shell_execute_command(const char *command_line)
     kprintf("Type 'help' for available commands.\n");
 }
 
+struct arena *shell_arena(void)
+{
+    return cmd_arena;
+}
+
 void shell_parse_args(const char *input, char **argv, int *argc)
 {
     static char args_buffer[SHELL_BUFFER_SIZE];
@@ -181,11 +207,25 @@ void cmd_help(int argc, char **argv)
     kprintf("  pageops     - Test page creation and management\n");
     kprintf("  kmalloctest - Test allocation functions (kmalloc, kfree, ksize)\n");
     kprintf("  vmalloctest - Test allocation functions (vmalloc, vfree, vsize)\n");
+    kprintf("  vmaptest    - Map scattered frames and the VGA buffer with vmap/ioremap\n");
+    kprintf("  cowtest     - Read a sparse vmalloc buffer through the zero page, then write to it\n");
     kprintf("  write       - Write int to any allocator addr: write <addr> <value>\n");
     kprintf("  read        - Read int from any allocator addr: read <addr>\n");
     kprintf("  rotest      - Test read-only page protection\n");
     kprintf("  pftest      - Test page fault handler by accessing invalid memory\n");
+    kprintf("  slabinfo    - Show slab cache utilisation\n");
+    kprintf("  arenatest   - Time arena bump allocation against kmalloc/kfree\n");
+    kprintf("  heapprof    - Allocation profile: heapprof [top_n|reset]\n");
+    kprintf("  pfstat      - Show demand paging regions and fault statistics\n");
+    kprintf("  tlbbench    - Compare page walks over 4MB and 4KB pages\n");
     kprintf("  panictest   - Test kernel panic handling\n");
+
+    // Time and interrupt commands
+    kprintf("Time / Interrupts:\n");
+    kprintf("  uptime      - Time since boot and the clocksource\n");
+    kprintf("  timertest   - Check timer wheel expiry, cascading, msleep and timeouts\n");
+    kprintf("  idlestat    - Idle residency, wakeups per second and skipped ticks\n");
+    kprintf("  irqstat     - Hits and handler latency per interrupt vector\n");
 }
 
 void cmd_clear(int argc, char **argv)
@@ -372,27 +412,205 @@ static uint32_t parse_hex_or_dec(const char *s)
     return val;
 }
 
+void cmd_uptime(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    const struct clocksource *cs = ktime_clocksource();
+    uint32_t ns;
+    uint32_t secs = (uint32_t)div_u64_rem(ktime_ns(), 1000000000, &ns);
+    uint32_t ms = ns / 1000000;
+    kprintf("up %d:%s%d:%s%d.%s%s%d (%d s)\n", secs / 3600,
+            (secs / 60) % 60 < 10 ? "0" : "", (secs / 60) % 60, secs % 60 < 10 ? "0" : "", secs % 60,
+            ms < 100 ? "0" : "", ms < 10 ? "0" : "", ms, secs);
+    kprintf("clocksource %s: %d kHz, %s, %s, mult %d shift %d\n", cs->name, cs->khz,
+            cs->invariant ? "invariant" : "not invariant",
+            cs->calibrated ? "calibrated against the PIT" : "uncalibrated", cs->mult, cs->shift);
+    uint32_t fired, cascaded;
+    timer_stats(&fired, &cascaded);
+    kprintf("jiffies %d (%d Hz), %d timers fired, %d cascaded\n", jiffies, HZ, fired, cascaded);
+}
+
+struct timertest_slot {
+    struct timer timer;
+    uint32_t fired_at;      // jiffies, 0 until it fires
+};
+
+static void timertest_fire(void *arg)
+{
+    ((struct timertest_slot*)arg)->fired_at = jiffies;
+}
+
+static void timertest_flag(void *arg)
+{
+    *(volatile int*)arg = 1;
+}
+
+// Elapsed milliseconds since t0 (ktime_ns), for short intervals
+static uint32_t ms_since(uint64_t t0)
+{
+    return (uint32_t)div_u64_rem(ktime_ns() - t0, 1000000, NULL);
+}
+
+// Ticks a timer may run late: an interrupt handler or a tickless catch-up can
+// hold IRQ0 back, so only firing early is a bug
+#define TIMERTEST_SLACK 2
+
+void cmd_timertest(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    uint64_t t0 = ktime_ns();
+    msleep(100);
+    uint32_t slept = ms_since(t0);
+    kprintf("msleep(100): %d ms %s\n", slept, slept >= 100 ? "[OK]" : "[FAIL]");
+
+    // The later ones sit in the second level and must be cascaded down first
+    static const uint32_t delays[] = { 5, 255, 300, 1200 };
+    struct timertest_slot slots[4];
+    struct timertest_slot dropped;
+    uint32_t now = jiffies;
+    for (int i = 0; i < 4; i++) {
+        slots[i].fired_at = 0;
+        timer_setup(&slots[i].timer, timertest_fire, &slots[i]);
+        timer_add(&slots[i].timer, now + msecs_to_jiffies(delays[i]));
+    }
+    dropped.fired_at = 0;
+    timer_setup(&dropped.timer, timertest_fire, &dropped);
+    timer_add(&dropped.timer, now + msecs_to_jiffies(50));
+    int was_pending = timer_del(&dropped.timer);
+
+    msleep(1250);
+    int ok = was_pending && !dropped.fired_at && !timer_pending(&dropped.timer);
+    for (int i = 0; i < 4; i++) {
+        uint32_t expected = now + msecs_to_jiffies(delays[i]);
+        kprintf("  timer +%d ms: fired at +%d ticks\n", delays[i], slots[i].fired_at ? slots[i].fired_at - now : 0);
+        if (!slots[i].fired_at || time_before(slots[i].fired_at, expected) ||
+            time_after(slots[i].fired_at, expected + TIMERTEST_SLACK)) ok = 0;
+        timer_del(&slots[i].timer);
+    }
+    kprintf("timers: %s\n", ok ? "[OK]" : "[FAIL]");
+
+    volatile int flag = 0;
+    struct timer wake;
+    timer_setup(&wake, timertest_flag, (void*)&flag);
+    timer_add(&wake, jiffies + msecs_to_jiffies(50));
+    t0 = ktime_ns();
+    int set = wait_timeout(&flag, 500);
+    uint32_t waited = ms_since(t0);
+    int timed_out = !wait_timeout(NULL, 20);
+    timer_del(&wake);
+    kprintf("wait_timeout: woken by the flag after %d ms, then a bare 20 ms timeout: %s\n", waited,
+            set && waited < 500 && timed_out ? "[OK]" : "[FAIL]");
+}
+
+// part / whole in tenths of a percent, both scaled down until whole fits 32 bits
+static uint32_t permille(uint64_t part, uint64_t whole)
+{
+    while (whole >> 32) {
+        part >>= 1;
+        whole >>= 1;
+    }
+    return whole ? (uint32_t)div_u64_rem(part * 1000, (uint32_t)whole, NULL) : 0;
+}
+
+static void idlestat_print(const char *label, uint64_t cycles, const struct idle_stats *st)
+{
+    uint32_t ms = (uint32_t)div_u64_rem(ktime_cycles_to_ns(cycles), 1000000, NULL);
+    uint32_t idle = permille(st->idle_cycles, cycles);
+    uint32_t rate = ms ? (uint32_t)div_u64_rem((uint64_t)st->wakeups * 1000, ms, NULL) : 0;
+    kprintf("%s %d ms: idle %d.%d%%, %d wakeups (%d/s), %d tickless periods, %d ticks skipped\n",
+            label, ms, idle / 10, idle % 10, st->wakeups, rate, st->tick_stops, st->ticks_skipped);
+}
+
+void cmd_idlestat(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    // The previous call's snapshot gives a window that excludes boot
+    static uint64_t last_cycles = 0;
+    static struct idle_stats last;
+    uint64_t now = ktime_cycles();
+    struct idle_stats st;
+    timer_idle_stats(&st);
+    idlestat_print("since boot,", now, &st);
+    if (last_cycles) {
+        struct idle_stats window = {
+            .idle_cycles = st.idle_cycles - last.idle_cycles,
+            .wakeups = st.wakeups - last.wakeups,
+            .tick_stops = st.tick_stops - last.tick_stops,
+            .ticks_skipped = st.ticks_skipped - last.ticks_skipped,
+        };
+        idlestat_print("since last idlestat,", now - last_cycles, &window);
+    }
+    last_cycles = now;
+    last = st;
+}
+
+void cmd_irqstat(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    // Latency is the handler's entry-to-exit time, interrupts nested in it included
+    for (int v = 0; v < IDT_ENTRIES; v++) {
+        struct irq_stat st;
+        irq_stat_get(v, &st);
+        if (!st.count) continue;
+        const char *name = irq_name(v);
+        uint32_t avg = (uint32_t)div_u64_rem(ktime_cycles_to_ns(st.cycles), st.count, NULL) / 1000;
+        uint32_t max = (uint32_t)div_u64_rem(ktime_cycles_to_ns(st.max_cycles), 1000, NULL);
+        kprintf("  %d %s: %d hits, avg %d us, max %d us\n", v, name ? name : "software", st.count, avg, max);
+    }
+    uint32_t queued, dropped, max_depth;
+    keyboard_ring_stats(&queued, &dropped, &max_depth);
+    kprintf("keyboard ring: %d scancodes queued, %d dropped, deepest backlog %d of %d\n",
+            queued, dropped, max_depth, KBD_RING_SIZE);
+}
+
 void cmd_meminfo(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 {
     kprintf("=== Memory Information ===\n");
     cmd_pmminfo(0, NULL);
 
     kprintf("\nAllocator Regions:\n");
-    kprintf("  kmalloc: %x - %x (64MB) - Physical memory\n", KHEAP_START, KHEAP_END);
-    kprintf("  vmalloc: %x - %x (32MB) - Kernel virtual memory\n", KVMEM_START, KVMEM_END);
-    kprintf("  vmalloc: %x - %x (64MB) - User virtual memory\n", VMEM_START, VMEM_END);
-    
+    kprintf("  direct:  %x - %x (%dMB) - Identity mapped RAM\n", 0, DIRECT_MAP_END - 1, DIRECT_MAP_END >> 20);
+    kprintf("  kmalloc: %x - %x (%dMB) - Physical memory\n", KHEAP_START, KHEAP_END, (KHEAP_END - KHEAP_START + 1) >> 20);
+    kprintf("  vmalloc: %x - %x (%dMB) - Kernel virtual memory\n", KVMEM_START, KVMEM_END, (KVMEM_END - KVMEM_START + 1) >> 20);
+    kprintf("  vmalloc: %x - %x (%dMB) - User virtual memory\n", VMEM_START, VMEM_END, (VMEM_END - VMEM_START + 1) >> 20);
+    kprintf("  user:    %x - %x (%dMB) - User processes\n", USER_PROCESS_START, USER_ZONE_END - 1, (USER_ZONE_END - USER_PROCESS_START) >> 20);
+    kprintf("\nKernel heap: break %x, %d KB mapped, %d KB used\n",
+            (uint32_t)ksbrk(0), kheap_total_bytes() / 1024, kheap_used_bytes() / 1024);
+    struct vmem_stats vs;
+    vmem_stats(&vs);
+    kprintf("vmalloc: %d KB in %d blocks, %d KB free VA in %d ranges (largest %d KB)\n",
+            vs.used / 1024, vs.busy_areas, vs.free / 1024, vs.free_areas, vs.largest_free / 1024);
+    kprintf("vmalloc purges: %d, %d blocks / %d pages unmapped (avg %d, max %d blocks per flush), %d KB pending\n",
+            vs.purges, vs.purged_areas, vs.purged_pages, vs.purges ? vs.purged_areas / vs.purges : 0,
+            vs.max_purge_batch, vs.lazy / 1024);
 }
 
 void cmd_pmminfo(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 {
     // Get PMM information
     uint32_t total_pages = pmm_total_pages();
-    uint32_t free_pages = pmm_free_pages();
+    uint32_t free_pages = pmm_free_page_count();
     
     kprintf("Physical Memory Manager (PMM):\n");
     kprintf("  Total pages: %d (%d MB)\n", total_pages, (total_pages * PAGE_SIZE) / (1024 * 1024));
     kprintf("  Free pages: %d (%d MB)\n", free_pages, (free_pages * PAGE_SIZE) / (1024 * 1024));
+    kprintf("  Highmem pages: %d (%d MB)\n", pmm_highmem_pages(), (pmm_highmem_pages() * PAGE_SIZE) / (1024 * 1024));
+    for (uint32_t zone = 0; zone < ZONE_COUNT; zone++) {
+        kprintf("  Zone %s: %d/%d pages free\n", pmm_zone_name(zone),
+                pmm_zone_free_pages(zone), pmm_zone_total_pages(zone));
+    }
+    kprintf("  Free blocks per order:");
+    for (uint32_t order = 0; order <= PMM_MAX_ORDER; order++) {
+        kprintf(" %d", pmm_free_blocks(order));
+    }
+    kprintf("\n");
+
+    static const char *type_names[PG_NR_TYPES] = {
+        "reserved", "free", "kernel", "heap", "pagetable", "vmalloc", "slab", "arena"
+    };
+    kprintf("  Zero pool: %d/%d pages, %d hits, %d misses\n", pmm_zero_pool_count(),
+            PMM_ZERO_POOL_TARGET, pmm_zero_pool_hits(), pmm_zero_pool_misses());
+    kprintf("  Pages by type:\n");
+    for (uint32_t type = 0; type < PG_NR_TYPES; type++) {
+        uint32_t pages = pmm_type_pages(type);
+        kprintf("    %s: %d (%d KB)\n", type_names[type], pages, pages * (PAGE_SIZE / 1024));
+    }
 }
 
 void cmd_kmalloc(int argc, char **argv)
@@ -499,7 +717,7 @@ void cmd_vget(int argc, char **argv)
     }
     uint32_t phys = (pte & 0xFFFFF000) | offset;
     uint32_t flags = pte & 0xFFF;
-    kprintf("physical: %x  flags: %x\n", phys, flags);
+    kprintf("physical: %x  flags: %x%s\n", phys, flags, (flags & PAGE_LARGE) ? " (4MB page)" : "");
 }
 
 
@@ -514,7 +732,7 @@ void cmd_page_ops(int argc __attribute__((unused)), char **argv __attribute__((u
         return;
     }
 
-    uint32_t virt = 0x10000000;
+    uint32_t virt = SCRATCH_START;
     if (vmm_map_page(virt, (uint32_t)phys, PAGE_WRITE) != 0) {
         kprintf("map failed\n");
         pmm_free_page(phys);
@@ -540,7 +758,7 @@ void cmd_present(int argc __attribute__((unused)), char **argv __attribute__((un
     kprintf("present test: 1. map 2. unmap 3. fault\n");
 
     // Pick a test virtual address - use an address that's definitely unmapped
-    uint32_t virt = 0x50000000; // This should be unmapped (outside first 12MB)
+    uint32_t virt = SCRATCH_START; // Nothing is ever mapped in the scratch window
 
     // Allocate and map one page
     void *phys = pmm_alloc_page();
@@ -578,6 +796,98 @@ void cmd_present(int argc __attribute__((unused)), char **argv __attribute__((un
     volatile uint32_t x = *(volatile uint32_t*)virt; // should fault
     (void)x;
 }
+struct op_stats {
+    uint32_t min, max, count;
+    uint64_t total;
+};
+
+static void op_stats_add(struct op_stats *st, uint32_t cycles)
+{
+    if (st->count == 0 || cycles < st->min) st->min = cycles;
+    if (cycles > st->max) st->max = cycles;
+    st->total += cycles;
+    st->count++;
+}
+
+static void op_stats_print(const char *name, struct op_stats *st)
+{
+    // No 64-bit division: scale both down until the total fits in 32 bits
+    uint64_t total = st->total;
+    uint32_t n = st->count;
+    while (total >> 32) {
+        total >>= 1;
+        n >>= 1;
+    }
+    kprintf("  %s: %d ops, min %d, avg %d, max %d cycles\n", name, st->count, st->min,
+            n ? (uint32_t)total / n : 0, st->max);
+}
+
+#define LATENCY_SLOTS 128
+
+static void kmalloc_latency_test(void)
+{
+    void **slots = arena_alloc(shell_arena(), LATENCY_SLOTS * sizeof(void*), 0);
+    if (!slots) {
+        kprintf("kmalloctest: arena_alloc for the latency slots failed\n");
+        return;
+    }
+    struct op_stats alloc_stats = { 0, 0, 0, 0 };
+    struct op_stats free_stats = { 0, 0, 0, 0 };
+    uint32_t seed = 12345;
+
+    for (int i = 0; i < LATENCY_SLOTS; i++) slots[i] = NULL;
+    for (int round = 0; round < 4096; round++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t slot = (seed >> 16) % LATENCY_SLOTS;
+        if (slots[slot]) {
+            uint64_t t0 = rdtsc();
+            kfree(slots[slot]);
+            op_stats_add(&free_stats, (uint32_t)(rdtsc() - t0));
+            slots[slot] = NULL;
+        } else {
+            // Mostly small objects, with the occasional multi-page block
+            uint32_t size = 16 + (seed >> 8) % 512;
+            if ((seed & 7) == 0) size = 4096 + (seed >> 4) % 32768;
+            uint64_t t0 = rdtsc();
+            slots[slot] = kmalloc(size);
+            op_stats_add(&alloc_stats, (uint32_t)(rdtsc() - t0));
+        }
+    }
+    for (int i = 0; i < LATENCY_SLOTS; i++) {
+        if (slots[i]) kfree(slots[i]);
+    }
+    kprintf("\n  Latency (cycles per operation):\n");
+    op_stats_print("kmalloc", &alloc_stats);
+    op_stats_print("kfree", &free_stats);
+}
+
+// krealloc growth/shrink in place, aligned carving and zeroed allocation
+static void kmalloc_api_test(void)
+{
+    uint8_t *buf = kmalloc(3000);
+    for (int i = 0; i < 3000; i++) buf[i] = (uint8_t)i;
+    uint8_t *grown = krealloc(buf, 12000);
+    int intact = 1;
+    for (int i = 0; i < 3000; i++) intact &= grown[i] == (uint8_t)i;
+    kprintf("\n  krealloc(%x, 12000) = %x (%s, data %s)\n", (uint32_t)buf, (uint32_t)grown,
+            grown == buf ? "in place" : "moved", intact ? "kept" : "LOST");
+    uint8_t *shrunk = krealloc(grown, 4000);
+    kprintf("  krealloc(%x, 4000) = %x, ksize %d\n", (uint32_t)grown, (uint32_t)shrunk, ksize(shrunk));
+    kfree(shrunk);
+
+    void *page = kmalloc_aligned(PAGE_SIZE, PAGE_SIZE);
+    void *line = kmalloc_aligned(100, 64);
+    kprintf("  kmalloc_aligned(4096, 4096) = %x, kmalloc_aligned(100, 64) = %x\n", (uint32_t)page, (uint32_t)line);
+    kfree(page);
+    kfree(line);
+
+    uint32_t *zero = kcalloc(4096, sizeof(uint32_t));
+    uint32_t dirty = 0;
+    for (int i = 0; i < 4096; i++) dirty |= zero[i];
+    kprintf("  kcalloc(4096, 4) = %x (%s)\n", (uint32_t)zero, dirty ? "NOT ZERO" : "zeroed");
+    kfree(zero);
+}
+
 void cmd_kmalloc_test(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 {   
     // Show initial memory stat
@@ -598,6 +908,12 @@ void cmd_kmalloc_test(int argc __attribute__((unused)), char **argv __attribute_
     kprintf("  ksize(%x) = %d bytes\n\n", (uint32_t)large1, ksize2);
     cmd_pmminfo(argc, argv);
     kfree(large1);
+
+    // Test 3: krealloc, kmalloc_aligned, kcalloc
+    kmalloc_api_test();
+
+    // Test 4: latency of kmalloc/kfree over a mix of slab and heap sizes
+    kmalloc_latency_test();
 }
 
 void cmd_vmalloc_test(int argc __attribute__((unused)), char **argv __attribute__((unused)))
@@ -621,6 +937,86 @@ void cmd_vmalloc_test(int argc __attribute__((unused)), char **argv __attribute_
     kprintf("  vsize(%x) = %d bytes\n\n", (uint32_t)vptr2, vsize2);
     cmd_pmminfo(argc, argv);
     vfree(vptr2);
+
+    // vfree must give every touched frame back; one warm-up round pays for the
+    // page table and the area nodes. Freed blocks are unmapped lazily, so purge
+    // before each count.
+    uint32_t free_before = 0;
+    for (int round = 0; round <= 64; round++) {
+        if (round == 1) {
+            vmem_purge();
+            free_before = pmm_free_page_count();
+        }
+        uint8_t *p = vmalloc(64 * 1024);
+        for (uint32_t off = 0; off < 64 * 1024; off += PAGE_SIZE) p[off] = (uint8_t)round;
+        vfree(p);
+    }
+    vmem_purge();
+    uint32_t free_after = pmm_free_page_count();
+    kprintf("\n  64 x vmalloc/vfree(64KB): %d -> %d free pages %s\n", free_before, free_after,
+            free_after >= free_before ? "[OK]" : "[LEAK]");
+}
+
+void cmd_vmaptest(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    // Every other frame of a run, so the window is backed by non-contiguous frames
+    void *run[16];
+    void *frames[8];
+    for (int i = 0; i < 16; i++) run[i] = pmm_alloc_page();
+    for (int i = 0; i < 8; i++) {
+        frames[i] = run[2 * i];
+        pmm_free_page(run[2 * i + 1]);
+        *(volatile uint32_t*)frames[i] = 0x1000 + i;
+    }
+
+    uint8_t *win = vmap(frames, 8, PAGE_WRITE);
+    kprintf("vmap(8 frames) -> %x\n", (uint32_t)win);
+    int ok = win != NULL;
+    for (int i = 0; ok && i < 8; i++) {
+        if (*(volatile uint32_t*)(win + i * PAGE_SIZE) != 0x1000u + i) ok = 0;
+        // Writes through the window land in the frame
+        *(volatile uint32_t*)(win + i * PAGE_SIZE + PAGE_SIZE - 4) = 0xA5A50000 + i;
+        if (*(volatile uint32_t*)((uint8_t*)frames[i] + PAGE_SIZE - 4) != 0xA5A50000u + i) ok = 0;
+    }
+    kprintf("  frames seen through the window: %s\n", ok ? "[OK]" : "[FAIL]");
+    vunmap(win);
+    for (int i = 0; i < 8; i++) pmm_free_page(frames[i]);
+
+    // The VGA text buffer, uncached, as a driver would map device memory
+    volatile uint16_t *vga = ioremap(0xB8000, 80 * 25 * 2, IOREMAP_UC);
+    kprintf("ioremap(%x, UC) -> %x, PTE %x\n", 0xB8000, (uint32_t)vga, vmm_get_mapping((uint32_t)vga));
+    if (vga) {
+        kprintf("  first cell %x, direct map %x: %s\n", vga[0], *(volatile uint16_t*)0xB8000,
+                vga[0] == *(volatile uint16_t*)0xB8000 ? "[OK]" : "[FAIL]");
+        iounmap((void*)vga);
+    }
+}
+
+void cmd_cowtest(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    const uint32_t pages = 256;
+    uint8_t *buf = vmalloc(pages * PAGE_SIZE);
+    uint32_t free0 = pmm_free_page_count();
+    uint32_t cow0 = vmm_cow_faults();
+
+    // Reads map the shared zero page: at most a page table (and the zero page itself,
+    // the first time) is spent
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < pages; i++) sum += buf[i * PAGE_SIZE];
+    uint32_t free1 = pmm_free_page_count();
+    kprintf("read %d pages: sum %d, %d frames used %s\n", pages, sum, free0 - free1,
+            sum == 0 && free0 - free1 <= 2 ? "[OK]" : "[FAIL]");
+
+    // One store every 16 pages gives exactly those pages a frame
+    for (uint32_t i = 0; i < pages; i += 16) buf[i * PAGE_SIZE + 1] = 0x5A;
+    uint32_t free2 = pmm_free_page_count();
+    uint32_t cows = vmm_cow_faults() - cow0;
+    kprintf("wrote %d pages: %d frames used, %d copy-on-write faults %s\n", pages / 16, free1 - free2, cows,
+            free1 - free2 == pages / 16 && cows == pages / 16 && buf[1] == 0x5A && buf[2] == 0 ? "[OK]" : "[FAIL]");
+
+    vfree(buf);
+    vmem_purge();
+    kprintf("after vfree: %d frames back\n", pmm_free_page_count() - free2);
 }
 
 void cmd_virtual_physical(int argc __attribute__((unused)), char **argv __attribute__((unused)))
@@ -649,7 +1045,7 @@ void cmd_virtual_physical(int argc __attribute__((unused)), char **argv __attrib
     
     // Test 3: Memory mapping
     kprintf("3. Memory Mapping:\n");
-    uint32_t virt_addr = 0x20000000;
+    uint32_t virt_addr = SCRATCH_START;
     void *phys_page = pmm_alloc_page();
     
     int map_result = vmm_map_page(virt_addr, (uint32_t)phys_page, PAGE_WRITE | PAGE_USER);
@@ -672,13 +1068,197 @@ void cmd_virtual_physical(int argc __attribute__((unused)), char **argv __attrib
     
 }
 
+// Touch one cache line per 4KB page over [base, base + pages * PAGE_SIZE), `passes` times
+static uint32_t tlb_walk(uint32_t base, uint32_t pages, uint32_t passes)
+{
+    uint32_t sum = 0;
+    for (uint32_t p = 0; p < passes; p++) {
+        for (uint32_t i = 0; i < pages; i++) {
+            // Rotate the line inside the page so the walk does not hammer one cache set
+            sum += *(volatile uint8_t*)(base + i * PAGE_SIZE + ((i * 64) & 0xFFF));
+        }
+    }
+    return sum;
+}
+
+void cmd_tlbbench(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    // Direct map from 4MB on: plain RAM, read only, mapped with 4MB pages at boot
+    uint32_t base = 0x00400000;
+    uint32_t bytes = 16 * 1024 * 1024;
+    if (DIRECT_MAP_END < base + 0x00400000) {
+        kprintf("tlbbench: direct map too small\n");
+        return;
+    }
+    if (DIRECT_MAP_END - base < bytes) bytes = DIRECT_MAP_END - base;
+    uint32_t pages = bytes / PAGE_SIZE;
+    uint32_t passes = 8;
+    if (!vmm_large_pages_enabled()) {
+        kprintf("tlbbench: no PSE, the direct map already uses 4KB pages\n");
+        return;
+    }
+
+    tlb_walk(base, pages, 1); // warm the caches
+    uint64_t t0 = rdtsc();
+    tlb_walk(base, pages, passes);
+    uint32_t large = (uint32_t)(rdtsc() - t0);
+
+    // Same memory through 4KB PTEs
+    for (uint32_t va = base; va < base + bytes; va += 0x00400000) {
+        if (vmm_split_large_page(va) != 0) {
+            kprintf("tlbbench: split failed at %x\n", va);
+            return;
+        }
+    }
+    tlb_walk(base, pages, 1);
+    t0 = rdtsc();
+    tlb_walk(base, pages, passes);
+    uint32_t small = (uint32_t)(rdtsc() - t0);
+    for (uint32_t va = base; va < base + bytes; va += 0x00400000) {
+        vmm_collapse_large_page(va);
+    }
+
+    uint32_t accesses = pages * passes;
+    kprintf("tlbbench: %d pages x %d passes over %x-%x\n", pages, passes, base, base + bytes - 1);
+    kprintf("  4MB pages: %d cycles (%d per access)\n", large, large / accesses);
+    kprintf("  4KB pages: %d cycles (%d per access)\n", small, small / accesses);
+}
+
+void cmd_pfstat(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    uint32_t count, max_cycles;
+    uint64_t cycles;
+    vmm_fault_stats(&count, &cycles, &max_cycles);
+
+    kprintf("Demand paging regions:\n");
+    const struct vm_region *r;
+    for (uint32_t i = 0; (r = vmm_region_get(i)) != NULL; i++) {
+        kprintf("  %s: %x-%x %s%s, %d pages/fault, %d faults, %d pages backed, %d on the zero page\n",
+                r->name, r->start, r->end, ((r->policy & VM_POLICY_MASK) == VM_LAZY) ? "lazy" : "eager",
+                (r->policy & VM_ZERO) ? " zeroed" : "", r->fault_around, r->faults, r->pages, r->zero_pages);
+    }
+
+    // No 64-bit division here: scale both down until the total fits in 32 bits
+    uint32_t n = count;
+    while (cycles >> 32) {
+        cycles >>= 1;
+        n >>= 1;
+    }
+    kprintf("Faults handled: %d (%d copy-on-write), avg %d cycles, max %d cycles\n",
+            count, vmm_cow_faults(), n ? (uint32_t)cycles / n : 0, max_cycles);
+}
+
+void cmd_slabinfo(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    kprintf("name          objsize  active/total  slabs  pages/slab  used\n");
+    const struct kmem_cache *c;
+    for (uint32_t i = 0; (c = kmem_cache_get(i)) != NULL; i++) {
+        uint32_t total = c->nr_slabs * c->objs_per_slab;
+        uint32_t bytes = c->nr_slabs * (PAGE_SIZE << c->order);
+        uint32_t used = bytes ? (c->active_objs * c->size) / (bytes / 100) : 0;
+        kprintf("%s: %d  %d/%d  %d  %d  %d%%\n", c->name, c->size, c->active_objs, total,
+                c->nr_slabs, 1 << c->order, used);
+    }
+}
+
+#define ARENATEST_OBJS 1024
+
+void cmd_arenatest(int argc __attribute__((unused)), char **argv __attribute__((unused)))
+{
+    struct arena *a = shell_arena();
+    void **objs = arena_alloc(a, ARENATEST_OBJS * sizeof(void*), 0);
+    if (!objs) {
+        kprintf("arenatest: arena_alloc(%d) failed\n", (int)(ARENATEST_OBJS * sizeof(void*)));
+        return;
+    }
+    struct op_stats bump = { 0, 0, 0, 0 };
+    struct op_stats heap = { 0, 0, 0, 0 };
+
+    // Same mix of small scratch sizes through both allocators
+    for (uint32_t i = 0; i < ARENATEST_OBJS; i++) {
+        uint32_t size = 16 + (i * 37) % 240;
+        uint64_t t0 = rdtsc();
+        objs[i] = arena_alloc(a, size, 0);
+        op_stats_add(&bump, (uint32_t)(rdtsc() - t0));
+        if (!objs[i]) {
+            kprintf("arenatest: arena_alloc(%d) failed after %d objects\n", (int)size, (int)i);
+            return;
+        }
+    }
+    kprintf("arenatest: %d objects, %d bytes in %d chunks\n", a->allocs, a->bytes, a->chunks);
+    for (uint32_t i = 0; i < ARENATEST_OBJS; i++) {
+        uint32_t size = 16 + (i * 37) % 240;
+        uint64_t t0 = rdtsc();
+        objs[i] = kmalloc(size);
+        op_stats_add(&heap, (uint32_t)(rdtsc() - t0));
+    }
+    uint64_t t0 = rdtsc();
+    for (uint32_t i = 0; i < ARENATEST_OBJS; i++) kfree(objs[i]);
+    uint32_t free_cycles = (uint32_t)(rdtsc() - t0);
+
+    op_stats_print("arena_alloc", &bump);
+    op_stats_print("kmalloc", &heap);
+    kprintf("  kfree of all objects: %d cycles; the arena drops them in one reset on return\n", free_cycles);
+}
+
+#define HEAPPROF_MAX_SITES PROF_SITES
+
+void cmd_heapprof(int argc, char **argv)
+{
+#if ALLOC_PROFILE
+    static const char *names[PROF_ALLOCATORS] = { "kmalloc", "vmalloc" };
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        allocprof_reset();
+        kprintf("heapprof: counters cleared\n");
+        return;
+    }
+    uint32_t want = argc > 1 ? parse_hex_or_dec(argv[1]) : 10;
+    if (want == 0 || want > HEAPPROF_MAX_SITES) want = HEAPPROF_MAX_SITES;
+
+    if (ALLOC_PROFILE > 1) kprintf("Allocation profile (1 in %d allocations sampled)\n", ALLOC_PROFILE);
+    else kprintf("Allocation profile (every allocation)\n");
+
+    struct allocprof_site *top = arena_alloc(shell_arena(), want * sizeof(*top), 0);
+    if (!top) {
+        kprintf("heapprof: arena_alloc(%d) failed\n", (int)(want * sizeof(*top)));
+        return;
+    }
+    uint32_t n = allocprof_top(top, want);
+    kprintf("Top %d call sites by live bytes:\n", n);
+    kprintf("  site      allocator  count  live  peak  total\n");
+    for (uint32_t i = 0; i < n; i++) {
+        kprintf("  %x  %s  %d  %d  %d  %d\n", (uint32_t)top[i].site, names[top[i].allocator],
+                top[i].count, top[i].live_bytes, top[i].peak_bytes, top[i].total_bytes);
+    }
+
+    for (uint32_t a = 0; a < PROF_ALLOCATORS; a++) {
+        const struct allocprof_stats *st = allocprof_stats(a);
+        struct op_stats alloc = { st->alloc.min, st->alloc.max, st->alloc.count, st->alloc.total };
+        struct op_stats release = { st->free.min, st->free.max, st->free.count, st->free.total };
+        kprintf("\n%s:\n", names[a]);
+        op_stats_print("alloc", &alloc);
+        op_stats_print("free", &release);
+        if (st->untracked) kprintf("  %d sampled blocks not tracked (live table full)\n", st->untracked);
+        kprintf("  sizes:");
+        for (uint32_t b = 0; b < PROF_SIZE_BINS; b++) {
+            if (st->size_hist[b]) kprintf(" %d+:%d", 1u << b, st->size_hist[b]);
+        }
+        kprintf("\n");
+    }
+#else
+    (void)argc;
+    (void)argv;
+    kprintf("heapprof: profiling is compiled out; rebuild with 'make ALLOC_PROFILE=1' (or =N to sample 1 in N)\n");
+#endif
+}
+
 void cmd_panic_test(int argc __attribute__((unused)), char **argv __attribute__((unused)))
 {
     // Test 1: Fatal Panic Test - Out of Memory
     kprintf("Fatal Panic Test - Out of Memory:\n");
     kprintf("   Testing kpanic_fatal() on out of memory...\n");
 
-    void *huge_alloc = kmalloc(50 * 1024 * 1024); 
+    void *huge_alloc = kmalloc(KHEAP_END - KHEAP_START + 1); 
     (void)huge_alloc; // This will call kpanic_fatal("PMM out of memory")
 }
 
@@ -768,35 +1348,18 @@ void cmd_write(int argc, char **argv)
         return;
     }
 
-    // Check address range and call appropriate size function
-    size_t alloc_size = 0;
-    const char *alloc_type = "unknown";
-    
-    // Kernel heap range: 0x04000000 - 0x07FFFFFF (64MB)
-    if (addr >= KHEAP_START && addr < KHEAP_END) {
-        alloc_size = ksize((void*)addr);
-        alloc_type = "kmalloc";
-    }
-    // Kernel vmalloc range: 0x02000000 - 0x03FFFFFF (32MB) 
-    else if (addr >= KVMEM_START && addr < KVMEM_END) {
-        alloc_size = vsize((void*)addr);
-        alloc_type = "kvmalloc";
-    }
-    // User vmalloc range: 0x40000000 - 0x43FFFFFF (64MB)
-    else if (addr >= VMEM_START && addr < VMEM_END) {
-        alloc_size = vsize((void*)addr);
-        alloc_type = "vmalloc";
-    }
-    // Removed umalloc - using vmalloc for user space
-    
-    if (alloc_size > 0) {
-        // Writing 4 bytes to a valid allocation
-        if (4 > alloc_size) {
+    // Find the allocation that owns addr; interior pointers count too
+    struct kptr_info info;
+    if (kptr_owner((void*)addr, &info) == 0) {
+        // Writing 4 bytes needs 4 bytes left before the end of the allocation
+        size_t offset = addr - (uint32_t)info.start;
+        if (4 > info.size - offset) {
             kpanic_fatal("write: buffer overflow detected! Writing 4 bytes to %s allocation of %d bytes at %p\n", 
-                        alloc_type, (int)alloc_size, (void*)addr);
+                        info.allocator, (int)info.size, (void*)addr);
             return;
         }
-        kprintf("write: writing to %s allocation (%d bytes) at %p\n", alloc_type, (int)alloc_size, addr);
+        kprintf("write: writing to %s allocation (%d bytes at %x, offset %d)\n", info.allocator,
+                (int)info.size, (uint32_t)info.start, (int)offset);
     } else {
         kprintf("write: WARNING - address %p not recognized as valid allocation\n", (void*)addr);
         return;
@@ -818,35 +1381,18 @@ void cmd_read(int argc, char **argv)
 
     // Note: allocators guarantee proper alignment for user data
 
-    // Check address range and call appropriate size function
-    size_t alloc_size = 0;
-    const char *alloc_type = "unknown";
-    
-    // Kernel heap range: 0x04000000 - 0x07FFFFFF (64MB)
-    if (addr >= KHEAP_START && addr < KHEAP_END) {
-        alloc_size = ksize((void*)addr);
-        alloc_type = "kmalloc";
-    }
-    // Kernel vmalloc range: 0x02000000 - 0x03FFFFFF (32MB) 
-    else if (addr >= KVMEM_START && addr < KVMEM_END) {
-        alloc_size = vsize((void*)addr);
-        alloc_type = "kvmalloc";
-    }
-    // User vmalloc range: 0x40000000 - 0x43FFFFFF (64MB)
-    else if (addr >= VMEM_START && addr < VMEM_END) {
-        alloc_size = vsize((void*)addr);
-        alloc_type = "vmalloc";
-    }
-    // Removed umalloc - using vmalloc for user space
-    
-    if (alloc_size > 0) {
-        // Reading 4 bytes from a valid allocation
-        if (4 > alloc_size) {
+    // Find the allocation that owns addr; interior pointers count too
+    struct kptr_info info;
+    if (kptr_owner((void*)addr, &info) == 0) {
+        // Reading 4 bytes needs 4 bytes left before the end of the allocation
+        size_t offset = addr - (uint32_t)info.start;
+        if (4 > info.size - offset) {
             kpanic_fatal("read: buffer overflow detected! Reading 4 bytes from %s allocation of %d bytes at %p\n", 
-                        alloc_type, (int)alloc_size, (void*)addr);
+                        info.allocator, (int)info.size, (void*)addr);
             return;
         }
-        kprintf("read: reading from %s allocation (%d bytes) at %p\n", alloc_type, (int)alloc_size, addr);
+        kprintf("read: reading from %s allocation (%d bytes at %x, offset %d)\n", info.allocator,
+                (int)info.size, (uint32_t)info.start, (int)offset);
     } else {
         kprintf("read: WARNING - address %p not recognized as valid allocation\n", (void*)addr);
         return;
@@ -872,7 +1418,7 @@ void cmd_rotest(int argc, char **argv)
     kprintf("rotest: allocated physical page at %x\n", (uint32_t)phys_page);
     
     // Map it as read-only (PAGE_PRESENT only, no PAGE_WRITE)
-    uint32_t virt_addr = 0x50000000;  // Use a high virtual address
+    uint32_t virt_addr = SCRATCH_START;  // Use the unmapped scratch window
     int result = vmm_map_page(virt_addr, (uint32_t)phys_page, PAGE_PRESENT);
     if (result != 0) {
         kprintf("rotest: failed to map read-only page\n");
@@ -913,11 +1459,11 @@ void cmd_pftest(int argc, char **argv)
     
     // Test 1: Access unmapped memory (should trigger not-present fault)
     kprintf("Test 1: Accessing unmapped memory\n");
-    kprintf("pftest: About to access 0x12345678 (unmapped)...\n");
+    kprintf("pftest: About to access %x (unmapped)...\n", SCRATCH_START + 0x345678);
     kprintf("pftest: This should trigger a page fault!\n");
     
     // This should trigger a page fault
-    volatile uint32_t *unmapped = (volatile uint32_t*)0x12345678;
+    volatile uint32_t *unmapped = (volatile uint32_t*)(SCRATCH_START + 0x345678);
     uint32_t value = *unmapped;  // This will cause a page fault
     (void)value;  // Suppress unused variable warning
     
@@ -931,12 +1477,12 @@ void cmd_pftest2(int argc, char **argv)
     (void)argc; (void)argv;
     
     kprintf("=== Simple Page Fault Test ===\n");
-    kprintf("pftest2: About to access unmapped memory at 0x20000000\n");
+    kprintf("pftest2: About to access unmapped memory at %x\n", SCRATCH_START);
     kprintf("pftest2: This should trigger a page fault!\n");
     kprintf("pftest2: If you see this message after the access, the handler isn't working.\n");
     
     // This should definitely cause a page fault
-    volatile uint32_t *ptr = (volatile uint32_t*)0x20000000;
+    volatile uint32_t *ptr = (volatile uint32_t*)SCRATCH_START;
     uint32_t value = *ptr;  // This will cause a page fault
     (void)value;
     
@@ -9,6 +9,7 @@ extern void outb(uint16_t port, uint8_t val);
 #define SHELL_BUFFER_SIZE 256
 #define SHELL_MAX_ARGS 16
 #define SHELL_PROMPT "kfs> "
+#define SHELL_ARENA_SIZE (16 * 1024)    // First chunk of the per-command arena
 
 // Shell command structure
 struct shell_command {
@@ -24,6 +25,8 @@ void shell_process_input(const char *input);
 void shell_execute_command(const char *command_line);
 void shell_parse_args(const char *input, char **argv, int *argc);
 void shell_print_prompt(void);
+// Scratch arena of the running command; everything in it is released when the command returns
+struct arena *shell_arena(void);
 
 // Built-in commands
 void cmd_help(int argc, char **argv);
@@ -37,6 +40,10 @@ void cmd_gdt_info(int argc, char **argv);
 // Forward declarations for new commands
 void cmd_version(int argc, char **argv);
 void cmd_shutdown(int argc, char **argv);
+void cmd_uptime(int argc, char **argv);
+void cmd_timertest(int argc, char **argv);
+void cmd_idlestat(int argc, char **argv);
+void cmd_irqstat(int argc, char **argv);
 void cmd_meminfo(int argc, char **argv);
 void cmd_pmminfo(int argc, char **argv);
 void cmd_kmalloc(int argc, char **argv);
@@ -57,6 +64,8 @@ void cmd_kill(int argc, char **argv);
 void cmd_page_ops(int argc, char **argv);
 void cmd_kmalloc_test(int argc, char **argv);
 void cmd_vmalloc_test(int argc, char **argv);
+void cmd_vmaptest(int argc, char **argv);
+void cmd_cowtest(int argc, char **argv);
 void cmd_virtual_physical(int argc, char **argv);
 void cmd_panic_test(int argc, char **argv);
 void cmd_ktest(int argc, char **argv);
@@ -69,4 +78,9 @@ void cmd_pftest2(int argc, char **argv);
 void cmd_pftest3(int argc, char **argv);
 void cmd_vtest(int argc, char **argv);
 void cmd_biostest(int argc, char **argv);
+void cmd_tlbbench(int argc, char **argv);
+void cmd_pfstat(int argc, char **argv);
+void cmd_slabinfo(int argc, char **argv);
+void cmd_heapprof(int argc, char **argv);
+void cmd_arenatest(int argc, char **argv);
 #endif
\ No newline at end of file
@@ -0,0 +1,282 @@
+#include "slab.h"
+#include "pmm.h"
+#include "panic.h"
+#include "kprintf.h"
+
+// Slab header, at the start of the slab's first page. Slabs are buddy blocks,
+// so the header of any object is found by masking its address with the slab size.
+struct slab {
+	struct kmem_cache *cache;
+	struct slab *next;
+	struct slab *prev;
+	void *freelist;             // First free object; each free object points to the next
+	uint32_t inuse;
+	uint32_t free_map[];        // One bit per object, set while it is free
+};
+
+// Caches for struct kmem_cache itself, and the generic kmalloc sizes
+static struct kmem_cache cache_cache;
+static struct kmem_cache *kmalloc_caches[9];
+static const char *kmalloc_names[9] = {
+	"kmalloc-8", "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128",
+	"kmalloc-256", "kmalloc-512", "kmalloc-1024", "kmalloc-2048"
+};
+static struct kmem_cache *cache_list = 0;
+
+static void slab_list_add(struct slab **head, struct slab *s)
+{
+	s->prev = 0;
+	s->next = *head;
+	if (*head) (*head)->prev = s;
+	*head = s;
+}
+
+static void slab_list_del(struct slab **head, struct slab *s)
+{
+	if (s->prev) s->prev->next = s->next;
+	else *head = s->next;
+	if (s->next) s->next->prev = s->prev;
+	s->next = s->prev = 0;
+}
+
+// First object of a slab holding objs objects: after the header and its free bitmap
+static uint32_t slab_offset(const struct kmem_cache *c, uint32_t objs)
+{
+	uint32_t header = sizeof(struct slab) + ((objs + 31) / 32) * sizeof(uint32_t);
+	return (header + c->align - 1) & ~(c->align - 1);
+}
+
+// Pick the smallest slab order that wastes at most 1/8 of the slab or holds 8 objects
+static int cache_layout(struct kmem_cache *c)
+{
+	c->objs_per_slab = 0;
+	for (uint32_t order = 0; order <= SLAB_MAX_ORDER; order++) {
+		uint32_t bytes = PAGE_SIZE << order;
+		// The bitmap grows with the object count, so fit the two together
+		uint32_t objs = bytes / c->size;
+		while (objs > 0 && slab_offset(c, objs) + objs * c->size > bytes) objs--;
+		if (!objs) continue;
+		c->offset = slab_offset(c, objs);
+		uint32_t waste = bytes - c->offset - objs * c->size;
+		c->order = order;
+		c->objs_per_slab = objs;
+		if (objs >= 8 || waste * 8 <= bytes) return 0;
+	}
+	return c->objs_per_slab > 0 ? 0 : -1;
+}
+
+// Index of the object at ptr within its slab
+static inline uint32_t slab_index(const struct kmem_cache *c, const struct slab *s, const void *ptr)
+{
+	return ((uint32_t)ptr - (uint32_t)s - c->offset) / c->size;
+}
+
+static inline int slab_is_free(const struct slab *s, uint32_t idx)
+{
+	return (s->free_map[idx >> 5] >> (idx & 31)) & 1;
+}
+
+static void cache_setup(struct kmem_cache *c, const char *name, size_t size, size_t align, void (*ctor)(void *obj))
+{
+	if (align < 8) align = 8;
+	if (size < KMALLOC_MIN_SIZE) size = KMALLOC_MIN_SIZE;
+	c->name = name;
+	c->align = align;
+	c->size = (size + align - 1) & ~(align - 1);
+	c->ctor = ctor;
+	c->partial = c->full = c->empty = 0;
+	c->nr_slabs = 0;
+	c->active_objs = 0;
+	c->next = 0;
+}
+
+static void cache_link(struct kmem_cache *c)
+{
+	struct kmem_cache **tail = &cache_list;
+	while (*tail) tail = &(*tail)->next;
+	*tail = c;
+}
+
+static struct slab *slab_new(struct kmem_cache *c)
+{
+	uint8_t *base = (uint8_t*)pmm_alloc_pages(c->order);
+	if (!base) return 0;
+	pmm_set_page_type(base, PG_SLAB);
+	// Tag the other frames too, so kmem_cache_of() works on any object
+	struct page *head = pmm_direct_page(base);
+	for (uint32_t i = 1; i < (1u << c->order); i++) {
+		head[i].flags = PG_SLAB;
+		head[i].order = c->order;
+	}
+
+	struct slab *s = (struct slab*)base;
+	s->cache = c;
+	s->inuse = 0;
+	s->freelist = 0;
+	for (uint32_t i = 0; i < (c->objs_per_slab + 31) / 32; i++) s->free_map[i] = 0;
+	// Thread the freelist from the last object down so allocation goes upwards
+	for (uint32_t i = c->objs_per_slab; i-- > 0;) {
+		void *obj = base + c->offset + i * c->size;
+		*(void**)obj = s->freelist;
+		s->free_map[i >> 5] |= 1u << (i & 31);
+		s->freelist = obj;
+	}
+	c->nr_slabs++;
+	return s;
+}
+
+static void slab_release(struct kmem_cache *c, struct slab *s)
+{
+	struct page *head = pmm_direct_page(s);
+	for (uint32_t i = 1; i < (1u << c->order); i++) {
+		head[i].flags = 0;
+		head[i].order = 0;
+	}
+	c->nr_slabs--;
+	pmm_free_pages(s, c->order);
+}
+
+void slab_init(void)
+{
+	cache_setup(&cache_cache, "kmem_cache", sizeof(struct kmem_cache), 8, 0);
+	cache_layout(&cache_cache);
+	cache_link(&cache_cache);
+
+	for (uint32_t i = 0; i < 9; i++) {
+		kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], KMALLOC_MIN_SIZE << i, 8, 0);
+		if (!kmalloc_caches[i]) {
+			kpanic_fatal("slab_init: cannot create %s\n", kmalloc_names[i]);
+		}
+	}
+	kprintf("Slab allocator initialized (kmalloc-%d..kmalloc-%d).\n", KMALLOC_MIN_SIZE, KMALLOC_MAX_SIZE);
+}
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj))
+{
+	if (align & (align - 1) || align > PAGE_SIZE) return 0;
+	struct kmem_cache *c = (struct kmem_cache*)kmem_cache_alloc(&cache_cache);
+	if (!c) return 0;
+	cache_setup(c, name, size, align, ctor);
+	if (cache_layout(c) != 0) {
+		// Objects too big for a slab
+		kmem_cache_free(&cache_cache, c);
+		return 0;
+	}
+	cache_link(c);
+	return c;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cache)
+{
+	if (!cache || cache == &cache_cache) return;
+	if (cache->active_objs) {
+		kpanic_fatal("kmem_cache_destroy: %s still has %d objects\n", cache->name, (int)cache->active_objs);
+		return;
+	}
+	while (cache->empty) {
+		struct slab *s = cache->empty;
+		slab_list_del(&cache->empty, s);
+		slab_release(cache, s);
+	}
+	struct kmem_cache **link = &cache_list;
+	while (*link && *link != cache) link = &(*link)->next;
+	if (*link) *link = cache->next;
+	kmem_cache_free(&cache_cache, cache);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *c)
+{
+	struct slab *s = c->partial;
+	if (!s) {
+		s = c->empty;
+		if (s) slab_list_del(&c->empty, s);
+		else s = slab_new(c);
+		if (!s) return 0;
+		slab_list_add(&c->partial, s);
+	}
+
+	void *obj = s->freelist;
+	s->freelist = *(void**)obj;
+	uint32_t idx = slab_index(c, s, obj);
+	s->free_map[idx >> 5] &= ~(1u << (idx & 31));
+	s->inuse++;
+	c->active_objs++;
+	if (!s->freelist) {
+		slab_list_del(&c->partial, s);
+		slab_list_add(&c->full, s);
+	}
+	if (c->ctor) c->ctor(obj);
+	return obj;
+}
+
+void kmem_cache_free(struct kmem_cache *c, void *ptr)
+{
+	uint32_t slab_bytes = PAGE_SIZE << c->order;
+	struct slab *s = (struct slab*)((uint32_t)ptr & ~(slab_bytes - 1));
+	uint32_t off = (uint32_t)ptr - (uint32_t)s;
+	if (s->cache != c || off < c->offset || (off - c->offset) % c->size) {
+		kpanic_fatal("kmem_cache_free: invalid object %x for cache %s\n", (uint32_t)ptr, c->name);
+		return;
+	}
+	uint32_t idx = slab_index(c, s, ptr);
+	if (idx >= c->objs_per_slab) {
+		kpanic_fatal("kmem_cache_free: invalid object %x for cache %s\n", (uint32_t)ptr, c->name);
+		return;
+	}
+	if (slab_is_free(s, idx)) {
+		kpanic_fatal("kmem_cache_free: double free detected at %x (%s)\n", (uint32_t)ptr, c->name);
+		return;
+	}
+
+	int was_full = s->freelist == 0;
+	*(void**)ptr = s->freelist;
+	s->free_map[idx >> 5] |= 1u << (idx & 31);
+	s->freelist = ptr;
+	s->inuse--;
+	c->active_objs--;
+	if (was_full) {
+		slab_list_del(&c->full, s);
+		slab_list_add(&c->partial, s);
+	}
+	if (s->inuse == 0) {
+		// Keep one empty slab around to absorb alloc/free ping-pong
+		slab_list_del(&c->partial, s);
+		if (!c->empty) slab_list_add(&c->empty, s);
+		else slab_release(c, s);
+	}
+}
+
+void *kmalloc_slab(size_t size)
+{
+	if (size == 0 || size > KMALLOC_MAX_SIZE) return 0;
+	uint32_t i = 0;
+	while ((size_t)(KMALLOC_MIN_SIZE << i) < size) i++;
+	return kmem_cache_alloc(kmalloc_caches[i]);
+}
+
+struct kmem_cache *kmem_cache_of(const void *ptr)
+{
+	struct page *page = pmm_direct_page(ptr);
+	if (!page || PG_TYPE(page) != PG_SLAB) return 0;
+	struct slab *s = (struct slab*)((uint32_t)ptr & ~((PAGE_SIZE << page->order) - 1));
+	return s->cache;
+}
+
+void *kmem_cache_obj(const void *ptr)
+{
+	struct kmem_cache *c = kmem_cache_of(ptr);
+	if (!c) return 0;
+	uint32_t base = (uint32_t)ptr & ~((PAGE_SIZE << c->order) - 1);
+	uint32_t off = (uint32_t)ptr - base;
+	if (off < c->offset) return 0;
+	uint32_t idx = (off - c->offset) / c->size;
+	if (idx >= c->objs_per_slab || slab_is_free((const struct slab*)base, idx)) return 0;
+	return (void*)(base + c->offset + idx * c->size);
+}
+
+const struct kmem_cache *kmem_cache_get(uint32_t index)
+{
+	const struct kmem_cache *c = cache_list;
+	while (c && index--) c = c->next;
+	return c;
+}
@@ -0,0 +1,50 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_MAX_ORDER   3        // Slabs are at most 2^3 pages
+#define KMALLOC_MIN_SIZE 8
+#define KMALLOC_MAX_SIZE 2048     // Larger kmalloc requests go to the heap
+
+struct slab;
+
+// Object cache: fixed-size objects carved out of page-backed slabs.
+// Each slab keeps its header at the start of its pages and a freelist threaded
+// through its free objects, so alloc and free are O(1). Whether an object is free
+// is recorded in a bitmap in the slab header, never in the object itself.
+struct kmem_cache {
+	const char *name;
+	uint32_t size;              // Object size, rounded up to align
+	uint32_t align;
+	uint32_t order;             // Pages per slab: 2^order
+	uint32_t objs_per_slab;
+	uint32_t offset;            // First object, from the start of the slab
+	void (*ctor)(void *obj);
+	struct slab *partial;
+	struct slab *full;
+	struct slab *empty;         // At most one slab is kept empty
+	uint32_t nr_slabs;
+	uint32_t active_objs;
+	struct kmem_cache *next;
+};
+
+void slab_init(void);
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size, size_t align, void (*ctor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *cache);
+void *kmem_cache_alloc(struct kmem_cache *cache);   // NULL when out of memory
+void kmem_cache_free(struct kmem_cache *cache, void *obj);
+
+// Generic kmalloc-8 .. kmalloc-2048 caches, used by kmalloc()
+void *kmalloc_slab(size_t size);
+// Cache owning ptr, or NULL if it is not a slab object
+struct kmem_cache *kmem_cache_of(const void *ptr);
+// Start of the live slab object containing ptr, or NULL
+void *kmem_cache_obj(const void *ptr);
+
+// Caches in creation order, for slabinfo; NULL past the last one
+const struct kmem_cache *kmem_cache_get(uint32_t index);
+
+#endif
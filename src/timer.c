@@ -0,0 +1,258 @@
+#include "timer.h"
+#include "kernel.h"
+#include "irq.h"
+#include "ktime.h"
+#include "kprintf.h"
+
+#define PIT_CH0_DATA 0x40
+#define PIT_COMMAND  0x43
+
+// Longest one-shot the 16-bit PIT counter allows, in ticks
+#define TICK_MAX_SKIP (65535 / (PIT_HZ / HZ))
+
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+// Slot of level n that the wheel is about to reach
+#define TVN_INDEX(n) ((timer_jiffies >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+volatile uint32_t jiffies = 0;
+
+static struct timer *tv1[TVR_SIZE];
+static struct timer *tvn[TVN_LEVELS][TVN_SIZE];
+static uint32_t timer_jiffies = 0;      // Next tick the wheel has to process
+
+static uint32_t timers_fired = 0;
+static uint32_t timers_cascaded = 0;
+
+// Tickless idle: while nothing is due the PIT runs one-shot up to the next event,
+// and the ticks it skipped are counted back from the TSC on the way out
+static uint32_t pit_divisor;             // PIT counts per tick
+static uint32_t tick_cycles;             // TSC cycles per tick
+static uint64_t tick_tsc;                // TSC at the last jiffies update
+static int tick_stopped = 0;
+static int in_idle = 0;
+static uint64_t idle_start;
+static struct idle_stats idle;
+
+static void timer_link(struct timer **head, struct timer *t)
+{
+	t->next = *head;
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = head;
+	*head = t;
+}
+
+static void timer_unlink(struct timer *t)
+{
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	t->next = 0;
+	t->pprev = 0;
+}
+
+static void internal_add(struct timer *t)
+{
+	uint32_t expires = t->expires;
+	uint32_t idx = expires - timer_jiffies;
+	struct timer **slot;
+	if ((int32_t)idx < 0) {
+		// Already due: the slot processed next
+		slot = &tv1[timer_jiffies & TVR_MASK];
+	} else if (idx < TVR_SIZE) {
+		slot = &tv1[expires & TVR_MASK];
+	} else {
+		uint32_t level = 0;
+		while (level < TVN_LEVELS - 1 && idx >= 1u << (TVR_BITS + (level + 1) * TVN_BITS)) level++;
+		slot = &tvn[level][(expires >> (TVR_BITS + level * TVN_BITS)) & TVN_MASK];
+	}
+	timer_link(slot, t);
+}
+
+// Spread one slot of a level over the levels below; returns the slot index so
+// the caller knows whether the next level has wrapped too
+static uint32_t cascade(uint32_t level, uint32_t index)
+{
+	struct timer *list = tvn[level][index];
+	tvn[level][index] = 0;
+	if (list) list->pprev = &list;
+	while (list) {
+		struct timer *t = list;
+		timer_unlink(t);
+		internal_add(t);
+		timers_cascaded++;
+	}
+	return index;
+}
+
+static void run_timers(void)
+{
+	while (time_after_eq(jiffies, timer_jiffies)) {
+		uint32_t index = timer_jiffies & TVR_MASK;
+		if (!index) {
+			for (uint32_t level = 0; level < TVN_LEVELS && !cascade(level, TVN_INDEX(level)); level++)
+				;
+		}
+		// Timers re-armed by a callback for "now" land in the next slot, not this one
+		timer_jiffies++;
+		struct timer *list = tv1[index];
+		tv1[index] = 0;
+		if (list) list->pprev = &list;
+		while (list) {
+			struct timer *t = list;
+			timer_unlink(t);
+			timers_fired++;
+			t->fn(t->arg);
+		}
+	}
+}
+
+static void pit_program(uint8_t mode, uint32_t count)
+{
+	outb(PIT_COMMAND, 0x30 | (mode << 1));  // Channel 0, lobyte/hibyte
+	outb(PIT_CH0_DATA, count & 0xFF);
+	outb(PIT_CH0_DATA, count >> 8);
+}
+
+// Earliest tick with work within max ticks: a filled one-tick slot, or the next
+// cascade, whose timers may be due right away
+static uint32_t next_event(uint32_t max)
+{
+	for (uint32_t j = 0; j < max; j++) {
+		uint32_t tick = timer_jiffies + j;
+		if (j && !(tick & TVR_MASK)) return tick;
+		if (tv1[tick & TVR_MASK]) return tick;
+	}
+	return timer_jiffies + max;
+}
+
+// One-shot interrupt delta ticks after the last one
+static void tick_stop(uint32_t delta)
+{
+	if (delta > TICK_MAX_SKIP) delta = TICK_MAX_SKIP;
+	uint32_t count = delta * pit_divisor;
+	uint64_t since = rdtsc() - tick_tsc;
+	if (since < tick_cycles) {
+		uint32_t elapsed = (uint32_t)div_u64_rem(since * pit_divisor, tick_cycles, NULL);
+		if (elapsed < count) count -= elapsed;
+	}
+	pit_program(0, count);
+	tick_stopped = 1;
+	idle.tick_stops++;
+}
+
+// Account the ticks that went by without interrupts and restart the periodic tick
+static void tick_resume(void)
+{
+	uint32_t n = (uint32_t)div_u64_rem(rdtsc() - tick_tsc, tick_cycles, NULL);
+	jiffies += n;
+	tick_tsc += (uint64_t)n * tick_cycles;
+	idle.ticks_skipped += n;
+	pit_program(2, pit_divisor);
+	tick_stopped = 0;
+}
+
+int timer_idle_exit(void)
+{
+	uint32_t flags = irq_save();
+	if (in_idle) {
+		idle.idle_cycles += rdtsc() - idle_start;
+		idle.wakeups++;
+		in_idle = 0;
+	}
+	int resumed = tick_stopped;
+	if (resumed) tick_resume();
+	irq_restore(flags);
+	return resumed;
+}
+
+void timer_idle(void)
+{
+	asm volatile("cli");
+	uint32_t delta = next_event(TICK_MAX_SKIP) - jiffies;
+	if (delta > 1) tick_stop(delta);
+	in_idle = 1;
+	idle_start = rdtsc();
+	// sti takes effect after hlt: an interrupt cannot slip in between and be slept through
+	asm volatile("sti; hlt" : : : "memory");
+	// Whatever woke us has run its handler, which normally closed the idle period already
+	timer_idle_exit();
+}
+
+void timer_idle_stats(struct idle_stats *st)
+{
+	uint32_t flags = irq_save();
+	*st = idle;
+	irq_restore(flags);
+}
+
+void timer_interrupt(struct regs *r __attribute__((unused)), void *ctx __attribute__((unused)))
+{
+	// The one-shot tick of an idle period catches jiffies up by itself
+	if (!timer_idle_exit()) {
+		jiffies++;
+		tick_tsc = rdtsc();
+	}
+	pic_send_eoi(0);
+	run_timers();
+}
+
+void timer_init(void)
+{
+	pit_divisor = PIT_HZ / HZ;
+	tick_cycles = (uint32_t)div_u64_rem((uint64_t)ktime_clocksource()->khz * 1000, HZ, NULL);
+	tick_tsc = rdtsc();
+	pit_program(2, pit_divisor);            // Rate generator
+	irq_register(IRQ0, timer_interrupt, NULL);
+	pic_unmask(0);
+	kprintf("Timer: PIT channel 0 at %d Hz\n", HZ);
+}
+
+void timer_setup(struct timer *t, void (*fn)(void *arg), void *arg)
+{
+	t->next = 0;
+	t->pprev = 0;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+void timer_add(struct timer *t, uint32_t expires)
+{
+	uint32_t flags = irq_save();
+	if (t->pprev) timer_unlink(t);
+	t->expires = expires;
+	internal_add(t);
+	irq_restore(flags);
+}
+
+int timer_del(struct timer *t)
+{
+	uint32_t flags = irq_save();
+	int pending = t->pprev != 0;
+	if (pending) timer_unlink(t);
+	irq_restore(flags);
+	return pending;
+}
+
+int wait_timeout(volatile const int *flag, uint32_t ms)
+{
+	// One extra tick: the current one is already partly over
+	uint32_t until = jiffies + msecs_to_jiffies(ms) + 1;
+	uint32_t flags = irq_save();
+	while (!(flag && *flag) && time_before(jiffies, until)) {
+		// sti only takes effect after hlt, so the wake-up tick cannot slip in between
+		asm volatile("sti; hlt; cli" : : : "memory");
+	}
+	irq_restore(flags);
+	return flag && *flag;
+}
+
+void msleep(uint32_t ms)
+{
+	wait_timeout(0, ms);
+}
+
+void timer_stats(uint32_t *fired, uint32_t *cascaded)
+{
+	*fired = timers_fired;
+	*cascaded = timers_cascaded;
+}
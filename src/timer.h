@@ -0,0 +1,70 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#define HZ 1000                  // PIT channel 0 ticks per second
+
+// Hierarchical timer wheel: 256 one-tick slots, then four levels of 64 slots,
+// each slot of a level spanning a whole turn of the level below. Adding and
+// deleting are O(1); a timer moves down one level each time its slot comes up.
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVN_LEVELS 4
+
+// Wrap-safe jiffies comparisons
+#define time_after(a, b)     ((int32_t)((b) - (a)) < 0)
+#define time_after_eq(a, b)  ((int32_t)((a) - (b)) >= 0)
+#define time_before(a, b)    time_after(b, a)
+
+struct timer {
+	struct timer *next;
+	struct timer **pprev;        // Link pointing at this timer; NULL when not pending
+	uint32_t expires;            // Absolute jiffies
+	void (*fn)(void *arg);       // Runs from IRQ0, interrupts off
+	void *arg;
+};
+
+extern volatile uint32_t jiffies;
+
+// Program PIT channel 0 at HZ and unmask IRQ0
+void timer_init(void);
+void timer_setup(struct timer *t, void (*fn)(void *arg), void *arg);
+// (Re)arm t for the absolute time expires; a time in the past fires on the next tick
+void timer_add(struct timer *t, uint32_t expires);
+// Returns 1 if t was pending
+int timer_del(struct timer *t);
+static inline int timer_pending(const struct timer *t) { return t->pprev != 0; }
+
+// Rounded up; HZ is a divisor or a multiple of 1000
+static inline uint32_t msecs_to_jiffies(uint32_t ms)
+{
+	return HZ >= 1000 ? ms * (HZ / 1000) : (ms + 1000 / HZ - 1) / (1000 / HZ);
+}
+
+// Halt until ms have passed; interrupts are enabled while halted, even if the caller has them off
+void msleep(uint32_t ms);
+// Halt until *flag is set or ms have passed; returns 1 if the flag was set
+int wait_timeout(volatile const int *flag, uint32_t ms);
+
+struct regs;
+void timer_interrupt(struct regs *r, void *ctx);
+void timer_stats(uint32_t *fired, uint32_t *cascaded);
+
+struct idle_stats {
+	uint64_t idle_cycles;        // TSC cycles spent halted in timer_idle
+	uint32_t wakeups;            // Interrupts that ended an idle period
+	uint32_t tick_stops;         // Idle periods run without the periodic tick
+	uint32_t ticks_skipped;      // Ticks accounted on wakeup instead of interrupted
+};
+
+// Idle loop body: halt until the next interrupt, with the tick stopped when the
+// next timer is more than one tick away
+void timer_idle(void);
+// Interrupt entry: close the idle period and restart the tick; returns 1 if it was stopped
+int timer_idle_exit(void);
+void timer_idle_stats(struct idle_stats *st);
+
+#endif
@@ -1,201 +1,436 @@
 #include "vmem.h"
 #include "paging.h"
 #include "pmm.h"
+#include "slab.h"
+#include "avl.h"
 #include "panic.h"
 #include "kprintf.h"
+#include "allocmap.h"
+#include "allocprof.h"
 
-// Virtual memory region for vmalloc
-static uint32_t vmem_current = KVMEM_START;
-static uint32_t vmem_size = 0;
+// A page-aligned run of vmalloc VA. Free areas are indexed twice: by address to
+// coalesce with their neighbours, and by (size, address) for best fit. Allocated
+// areas sit in busy_tree, by address.
+struct vm_area {
+	struct avl_node addr_node;  // free_by_addr or busy_tree
+	struct avl_node size_node;  // free_by_size; unused while allocated
+	uint32_t start;
+	uint32_t size;              // Bytes, guard page included
+	uint32_t requested;         // What vmalloc was asked for
+	uint32_t kind;              // VMA_*
+	struct vm_area *purge_next; // On the purge list, once freed
+};
 
-typedef struct vmem_block {
-	size_t size;           // Requested size (what user asked for)
-	size_t capacity;       // Actual capacity (page-aligned)
-	int free;
-	uint32_t magic;  // Magic number for double free detection
-	struct vmem_block *next;
-} vmem_block_t;
+#define VMA_ALLOC   0           // vmalloc: frames owned by the area, backed on demand
+#define VMA_VMAP    1           // vmap: caller's frames, mapped up front
+#define VMA_IOREMAP 2           // ioremap: device memory, mapped up front
 
-#define VMEM_MAGIC_ALLOCATED 0xDEADBEEF
-#define VMEM_MAGIC_FREED     0xFEEED000
+// End of the pages an area may back: vmalloc areas end with an unmapped guard page
+#define area_end(a) ((a)->start + (((a)->requested + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)))
 
-static vmem_block_t *vmem_list = 0;
+// Backing of the vmalloc zone: zero-filled on first touch, 8 pages per fault
+#define VMALLOC_POLICY       (VM_LAZY | VM_ZERO)
+#define VMALLOC_FAULT_AROUND 8
+// Never mapped: an overrun faults instead of running into the next allocation
+#define VMALLOC_GUARD        PAGE_SIZE
+// Freed VA parked for unmapping before a purge is forced
+#define VMALLOC_LAZY_MAX     (4 * 1024 * 1024)
 
-void *vmalloc(size_t size)
+static struct kmem_cache *area_cache;
+static struct avl_node *free_by_addr = 0;
+static struct avl_node *free_by_size = 0;
+static struct avl_node *busy_tree = 0;
+
+// Freed areas still mapped, waiting for the next purge: one TLB flush for all of them
+static struct vm_area *purge_list = 0;
+static uint32_t purge_bytes = 0;
+static uint32_t purge_runs = 0;
+static uint32_t purge_areas = 0;
+static uint32_t purge_pages = 0;
+static uint32_t purge_max_batch = 0;
+
+static uint32_t vmem_top = 0;     // End of the highest allocated area
+static uint32_t vmem_limit = 0;   // End of the usable zone, below its allocation bitmap
+
+// Starts of allocated blocks, at the top of the vmalloc zone
+static struct allocmap vmem_map;
+
+#define addr_area(n) avl_entry(n, struct vm_area, addr_node)
+#define size_area(n) avl_entry(n, struct vm_area, size_node)
+
+static int addr_cmp(const struct avl_node *a, const struct avl_node *b)
 {
-	if (size == 0) return 0;
-	
-    // Align to 8 bytes
-	if (size & 7) size = (size + 7) & ~7u;
-	
-	// Find free block or expand virtual region
-	vmem_block_t *prev = 0;
-	vmem_block_t *cur = vmem_list;
-	
-	while (cur) {
-		if (cur->free && cur->size >= size) {
-			// Split if large enough
-			if (cur->size >= size + sizeof(vmem_block_t) + 16) {
-				vmem_block_t *n = (vmem_block_t*)((uint8_t*)cur + sizeof(vmem_block_t) + size);
-				n->size = cur->size - size - sizeof(vmem_block_t);
-				n->free = 1;
-				n->next = cur->next;
-				cur->size = size;
-				cur->next = n;
-			}
-			cur->free = 0;
-			cur->magic = VMEM_MAGIC_ALLOCATED;
-			return (uint8_t*)cur + sizeof(vmem_block_t);
+	uint32_t x = addr_area(a)->start, y = addr_area(b)->start;
+	return x < y ? -1 : x > y;
+}
+
+static int size_cmp(const struct avl_node *a, const struct avl_node *b)
+{
+	const struct vm_area *x = size_area(a), *y = size_area(b);
+	if (x->size != y->size) return x->size < y->size ? -1 : 1;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Area with the greatest start <= addr in an address-ordered tree
+static struct vm_area *area_floor(struct avl_node *n, uint32_t addr)
+{
+	struct vm_area *best = 0;
+	while (n) {
+		struct vm_area *a = addr_area(n);
+		if (a->start <= addr) {
+			best = a;
+			n = n->right;
+		} else {
+			n = n->left;
 		}
-		prev = cur;
-		cur = cur->next;
-	}
-	
-	// Need to expand virtual region
-	uint32_t needed_pages = (size + sizeof(vmem_block_t) + PAGE_SIZE - 1) / PAGE_SIZE;
-	uint32_t new_vmem_end = vmem_current + needed_pages * PAGE_SIZE;
-	
-	// Check if expansion would exceed vmalloc region
-	if (new_vmem_end > KVMEM_END) {
-		kpanic_fatal("vmalloc: would exceed vmalloc region\n");
-	}
-	
-    // Map new pages
-	for (uint32_t va = vmem_current; va < new_vmem_end; va += PAGE_SIZE) {
-        void *phys = pmm_alloc_page();
-        if (!phys) {
-            kpanic_fatal("vmalloc: failed to allocate physical page\n");
-        }
-		if (vmm_map_page(va, (uint32_t)phys, PAGE_WRITE) != 0) {
-			kpanic_fatal("vmalloc: failed to map page\n");
+	}
+	return best;
+}
+
+// Smallest free area of at least size bytes, lowest address among equals
+static struct vm_area *best_fit(uint32_t size)
+{
+	struct avl_node *n = free_by_size;
+	struct vm_area *best = 0;
+	while (n) {
+		struct vm_area *a = size_area(n);
+		if (a->size >= size) {
+			best = a;
+			n = n->left;
+		} else {
+			n = n->right;
 		}
 	}
-	
-	// Create new block
-	vmem_block_t *new_block = (vmem_block_t*)vmem_current;
-	new_block->size = size;  // Store requested size
-	new_block->capacity = needed_pages * PAGE_SIZE - sizeof(vmem_block_t);  // Store actual capacity
-	new_block->free = 0;
-	new_block->magic = VMEM_MAGIC_ALLOCATED;
-	new_block->next = 0;
-	
-	if (prev) prev->next = new_block;
-	else vmem_list = new_block;
-	
-	vmem_current = new_vmem_end;
-	vmem_size += needed_pages * PAGE_SIZE;
-	
-	return (uint8_t*)new_block + sizeof(vmem_block_t);
+	return best;
 }
 
-void vfree(void *ptr)
+static void free_insert(struct vm_area *a)
+{
+	avl_insert(&free_by_addr, &a->addr_node, addr_cmp);
+	avl_insert(&free_by_size, &a->size_node, size_cmp);
+}
+
+static void free_remove(struct vm_area *a)
+{
+	avl_remove(&free_by_addr, &a->addr_node, addr_cmp);
+	avl_remove(&free_by_size, &a->size_node, size_cmp);
+}
+
+// Take [start, start + size) out of the free area a, which contains it; the
+// pieces left on either side stay free. NULL when no node is left for a split.
+static struct vm_area *area_take(struct vm_area *a, uint32_t start, uint32_t size)
+{
+	uint32_t end = start + size, a_end = a->start + a->size;
+	struct vm_area *lo = 0, *hi = 0;
+	if (start > a->start && !(lo = kmem_cache_alloc(area_cache))) return 0;
+	if (end < a_end && !(hi = kmem_cache_alloc(area_cache))) {
+		if (lo) kmem_cache_free(area_cache, lo);
+		return 0;
+	}
+	free_remove(a);
+	if (lo) {
+		lo->start = a->start;
+		lo->size = start - a->start;
+		free_insert(lo);
+	}
+	if (hi) {
+		hi->start = end;
+		hi->size = a_end - end;
+		free_insert(hi);
+	}
+	a->start = start;
+	a->size = size;
+	avl_insert(&busy_tree, &a->addr_node, addr_cmp);
+	if (end > vmem_top) vmem_top = end;
+	return a;
+}
+
+// Back to the free trees, merged with the free areas touching it
+static void area_release(struct vm_area *a)
+{
+	struct vm_area *prev = area_floor(free_by_addr, a->start);
+	if (prev && prev->start + prev->size == a->start) {
+		free_remove(prev);
+		prev->size += a->size;
+		kmem_cache_free(area_cache, a);
+		a = prev;
+	}
+	struct vm_area *next = area_floor(free_by_addr, a->start + a->size);
+	if (next && next->start == a->start + a->size) {
+		free_remove(next);
+		a->size += next->size;
+		kmem_cache_free(area_cache, next);
+	}
+	free_insert(a);
+}
+
+void vmem_purge(void)
+{
+	if (!purge_list) return;
+	uint32_t areas = 0;
+	for (struct vm_area *a = purge_list; a; a = a->purge_next) {
+		uint32_t npages = (area_end(a) - a->start) / PAGE_SIZE;
+		// Frames of vmap and ioremap windows belong to someone else
+		if (a->kind == VMA_ALLOC) purge_pages += vmm_region_release_noflush(a->start, npages);
+		else vmm_unmap_range_noflush(a->start, npages);
+		areas++;
+	}
+	vmm_flush_tlb();
+	// Only now can the VA be handed out again
+	while (purge_list) {
+		struct vm_area *a = purge_list;
+		purge_list = a->purge_next;
+		area_release(a);
+	}
+	purge_runs++;
+	purge_areas += areas;
+	if (areas > purge_max_batch) purge_max_batch = areas;
+	purge_bytes = 0;
+}
+
+// Lazy faults are only backed inside a vmalloc block, guard page excluded
+static int vmem_extent(uint32_t addr, uint32_t *start, uint32_t *end)
+{
+	struct vm_area *a = area_floor(busy_tree, addr);
+	if (!a || a->kind != VMA_ALLOC || addr >= area_end(a)) return 1;
+	*start = a->start;
+	*end = area_end(a);
+	return 0;
+}
+
+void vmem_init(void)
+{
+	// The kernel vmalloc zone is only known once memory_init has sized it
+	area_cache = kmem_cache_create("vm_area", sizeof(struct vm_area), 8, 0);
+	vmem_limit = allocmap_init(&vmem_map, "vmalloc-map", KVMEM_START, KVMEM_END + 1, PG_VMALLOC);
+	if (!area_cache || !vmem_limit) kpanic_fatal("vmem_init: no room for the vmalloc bookkeeping\n");
+	// The region spans the whole zone; the extent callback keeps faults inside allocations
+	if (vmm_region_add("vmalloc", KVMEM_START, vmem_limit, PAGE_WRITE, PG_VMALLOC,
+	                   VMALLOC_POLICY, VMALLOC_FAULT_AROUND) != 0) {
+		kpanic_fatal("vmem_init: no room for the vmalloc region\n");
+	}
+	vmm_region_set_extent(KVMEM_START, vmem_extent);
+
+	struct vm_area *all = kmem_cache_alloc(area_cache);
+	all->start = KVMEM_START;
+	all->size = vmem_limit - KVMEM_START;
+	free_insert(all);
+	vmem_top = KVMEM_START;
+}
+
+// Best-fit window of size bytes plus a guard page; NULL when the VA is exhausted
+static struct vm_area *area_alloc(size_t size, uint32_t kind)
+{
+	if (size == 0 || size > vmem_limit - KVMEM_START - VMALLOC_GUARD) return 0;
+	uint32_t bytes = ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) + VMALLOC_GUARD;
+	struct vm_area *a = best_fit(bytes);
+	if (!a && purge_list) {
+		// VA pressure: the parked ranges may be what is missing
+		vmem_purge();
+		a = best_fit(bytes);
+	}
+	// Carve from the low end so the tail stays one free area
+	if (!a || !area_take(a, a->start, bytes)) return 0;
+	a->requested = size;
+	a->kind = kind;
+	allocmap_set(&vmem_map, a->start);
+	return a;
+}
+
+static void *vmalloc_untracked(size_t size)
+{
+	if (size == 0) return 0;
+	if (size > vmem_limit - KVMEM_START) kpanic_fatal("vmalloc: would exceed vmalloc region\n");
+	struct vm_area *a = area_alloc(size, VMA_ALLOC);
+	if (!a) kpanic_fatal("vmalloc: no free range of %d bytes\n", size);
+	return (void*)a->start;
+}
+
+static struct vm_area *busy_find(uint32_t addr)
+{
+	struct vm_area *a = area_floor(busy_tree, addr);
+	return a && a->start == addr ? a : 0;
+}
+
+// The live area starting at addr, of the given kind, or a fatal panic naming who
+static struct vm_area *area_check(uint32_t addr, uint32_t kind, const char *who)
+{
+	if (!allocmap_test(&vmem_map, addr)) {
+		// Freed blocks and stray pointers both land here: the VA keeps no history
+		kpanic_fatal("%s: double free or invalid block at %x\n", who, addr);
+	}
+	struct vm_area *a = busy_find(addr);
+	if (!a) kpanic_fatal("%s: block %x has no area\n", who, addr);
+	if (a->kind != kind) kpanic_fatal("%s: block %x was not allocated by it\n", who, addr);
+	return a;
+}
+
+// Out of the busy tree and onto the purge list
+static void area_retire(struct vm_area *a)
+{
+	allocmap_clear(&vmem_map, a->start);
+	avl_remove(&busy_tree, &a->addr_node, addr_cmp);
+	struct avl_node *last = avl_last(busy_tree);
+	vmem_top = last ? addr_area(last)->start + addr_area(last)->size : KVMEM_START;
+
+	// Stays mapped, and out of the free trees, until the purge unmaps it
+	a->purge_next = purge_list;
+	purge_list = a;
+	purge_bytes += a->size;
+	if (purge_bytes >= VMALLOC_LAZY_MAX) vmem_purge();
+}
+
+static void vfree_untracked(void *ptr)
 {
 	if (!ptr) return;
-	
-	vmem_block_t *blk = (vmem_block_t*)((uint8_t*)ptr - sizeof(vmem_block_t));
-	
-	// Check for double free
-    if (blk->magic == VMEM_MAGIC_FREED) {
-        kpanic_fatal("vfree: double free detected at %x\n", (uint32_t)ptr);
-        return;
-    }
-	
-	// Check for invalid magic number
-    if (blk->magic != VMEM_MAGIC_ALLOCATED) {
-        kpanic_fatal("vfree: invalid memory block at %x (magic: %x)\n", (uint32_t)ptr, blk->magic);
-        return;
-    }
-	
-	// Mark as freed
-	blk->free = 1;
-	blk->magic = VMEM_MAGIC_FREED;
-	
-	// Merge with adjacent free blocks if possible, to reduce fragmentation
-	vmem_block_t *cur = vmem_list;
-	uint8_t *end_cur = (uint8_t*)cur + sizeof(vmem_block_t) + cur->capacity;
-	if (cur->free && cur->next->free && end_cur == (uint8_t*)cur->next) {
-		cur->capacity += sizeof(vmem_block_t) + cur->next->capacity;
-		cur->next = cur->next->next;
-	} else {
-		cur = cur->next;
-	}
-}
-
-// Helper function to validate if a block is properly allocated
-static int is_valid_allocated_block(vmem_block_t *blk)
-{
-	// Check if block is within virtual memory region
-	uint32_t block_addr = (uint32_t)blk;
-	if (block_addr < KVMEM_START || block_addr >= vmem_current) {
-		return 0; // Block is outside virtual memory region
-	}
-	
-	// Check if block header alignment is at least 8 bytes (allocator guarantees 8-byte alignment)
-	if (block_addr & 7) {
-		return 0; // Block header is not 8-byte aligned
-	}
-	
-	// Check if block is linked in the allocation list
-	vmem_block_t *cur = vmem_list;
-	while (cur) {
-		if (cur == blk) {
-			return 1; // Found in allocation list
-		}
-		cur = cur->next;
+	area_retire(area_check((uint32_t)ptr, VMA_ALLOC, "vfree"));
+}
+
+void *vmap(void *const frames[], uint32_t n, uint32_t flags)
+{
+	if (!frames || n == 0) return 0;
+	struct vm_area *a = area_alloc(n * PAGE_SIZE, VMA_VMAP);
+	if (!a) return 0;
+	if (vmm_map_frames(a->start, frames, n, flags) != 0) {
+		// No page table for part of the window: undo what was mapped
+		area_retire(a);
+		return 0;
 	}
-	
-	return 0; // Not found in allocation list
+	return (void*)a->start;
+}
+
+void vunmap(void *addr)
+{
+	if (!addr) return;
+	area_retire(area_check((uint32_t)addr, VMA_VMAP, "vunmap"));
+}
+
+void *ioremap(uint32_t phys, size_t size, uint32_t cache_mode)
+{
+	uint32_t offset = phys & (PAGE_SIZE - 1);
+	uint32_t base = phys - offset;
+	if (size == 0 || size > 0xFFFFFFFFu - phys) return 0;
+	uint32_t flags = PAGE_WRITE;
+	if (cache_mode == IOREMAP_UC) flags |= PAGE_NOCACHE | PAGE_WRITETHROUGH;
+	else if (cache_mode == IOREMAP_WT) flags |= PAGE_WRITETHROUGH;
+
+	struct vm_area *a = area_alloc(offset + size, VMA_IOREMAP);
+	if (!a) return 0;
+	if (vmm_map_range(a->start, base, (area_end(a) - a->start) / PAGE_SIZE, flags) != 0) {
+		area_retire(a);
+		return 0;
+	}
+	return (void*)(a->start + offset);
+}
+
+void iounmap(void *addr)
+{
+	if (!addr) return;
+	area_retire(area_check((uint32_t)addr & ~(PAGE_SIZE - 1), VMA_IOREMAP, "iounmap"));
+}
+
+void *vmalloc(size_t size)
+{
+	uint64_t t0 = allocprof_begin();
+	void *ptr = vmalloc_untracked(size);
+	allocprof_alloc(PROF_VMALLOC, __builtin_return_address(0), ptr, size, t0);
+	return ptr;
+}
+
+void vfree(void *ptr)
+{
+	uint64_t t0 = allocprof_free_begin(ptr);
+	vfree_untracked(ptr);
+	allocprof_free(PROF_VMALLOC, ptr, t0);
 }
 
 size_t vsize(void *ptr)
 {
 	if (!ptr) return 0;
-	
+
 	// Check if pointer is within virtual memory region
 	uint32_t ptr_addr = (uint32_t)ptr;
-	if (ptr_addr < KVMEM_START || ptr_addr >= vmem_current) {
+	if (ptr_addr < KVMEM_START || ptr_addr >= vmem_top) {
 		kprintf("[ERROR] vsize: invalid pointer %x (outside vmalloc allocated region)\n", ptr_addr);
 		return 0; // Pointer is outside virtual memory region
 	}
-	
-	vmem_block_t *blk = (vmem_block_t*)((uint8_t*)ptr - sizeof(vmem_block_t));
-	
-	// Check if block is still allocated
-	if (blk->magic != VMEM_MAGIC_ALLOCATED) {
-		kprintf("[ERROR] vsize: pointer %x refers to non-allocated block (magic=%x)\n", ptr_addr, blk->magic);
-		return 0; // Block is freed or invalid
+
+	// Only the start of a live block has its bit set
+	if (!allocmap_test(&vmem_map, ptr_addr)) {
+		kprintf("[ERROR] vsize: pointer %x is not the start of an allocated block\n", ptr_addr);
+		return 0; // Block is freed, or an interior/stray pointer
 	}
-	
-	// Additional validation: check if block is properly allocated
-	if (!is_valid_allocated_block(blk)) {
-		kprintf("[ERROR] vsize: pointer %x fails allocation validation\n", ptr_addr);
-		return 0; // Block is not properly allocated
+
+	return busy_find(ptr_addr)->requested;
+}
+
+void *vmem_owner(const void *addr)
+{
+	uint32_t a = (uint32_t)addr;
+	if (a < KVMEM_START || a >= vmem_top) return 0;
+	struct vm_area *area = area_floor(busy_tree, a);
+	return area && a < area->start + area->requested ? (void*)area->start : 0;
+}
+
+void vmem_stats(struct vmem_stats *st)
+{
+	st->used = st->free = st->largest_free = 0;
+	st->busy_areas = st->free_areas = 0;
+	st->lazy = purge_bytes;
+	st->purges = purge_runs;
+	st->purged_areas = purge_areas;
+	st->purged_pages = purge_pages;
+	st->max_purge_batch = purge_max_batch;
+	// Preorder walk; AVL height stays under 1.44 log2(n), far below the stack size
+	struct avl_node *stack[64];
+	uint32_t depth = 0;
+	struct avl_node *roots[2] = { busy_tree, free_by_addr };
+	for (int t = 0; t < 2; t++) {
+		if (roots[t]) stack[depth++] = roots[t];
+		while (depth) {
+			struct avl_node *n = stack[--depth];
+			struct vm_area *a = addr_area(n);
+			if (t == 0) {
+				st->used += area_end(a) - a->start;
+				st->busy_areas++;
+			} else {
+				st->free += a->size;
+				if (a->size > st->largest_free) st->largest_free = a->size;
+				st->free_areas++;
+			}
+			if (n->left) stack[depth++] = n->left;
+			if (n->right) stack[depth++] = n->right;
+		}
 	}
-	
-	return blk->size;
 }
 
 void *vbrk(void *new_brk)
 {
 	if (new_brk == 0) {
-		return (void*)vmem_current;
+		return (void*)vmem_top;
 	}
-	
+
 	uint32_t new_addr = (uint32_t)new_brk;
-	if (new_addr < KVMEM_START || new_addr < vmem_current) {
+	if (new_addr < KVMEM_START || new_addr < vmem_top || new_addr > vmem_limit) {
 		return (void*)-1; // Invalid break
 	}
-	
-	// Expand virtual region if needed
-	while (vmem_current < new_addr) {
-		uint32_t va = vmem_current;
-		void *phys = pmm_alloc_page();
-		if (vmm_map_page(va, (uint32_t)phys, PAGE_WRITE) != 0) {
-			kpanic_fatal("vbrk: failed to map page\n");
+
+	// Reserve [top, new break) as one block without a guard page; vfree(old break) returns it
+	uint32_t end = (new_addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (end > vmem_top) {
+		uint32_t start = vmem_top;
+		struct vm_area *a = area_floor(free_by_addr, start);
+		if ((!a || a->start + a->size < end) && purge_list) {
+			vmem_purge();
+			a = area_floor(free_by_addr, start);
 		}
-		vmem_current += PAGE_SIZE;
-		vmem_size += PAGE_SIZE;
+		if (!a || a->start + a->size < end || !area_take(a, start, end - start)) {
+			return (void*)-1;
+		}
+		a->requested = end - start;
+		a->kind = VMA_ALLOC;
+		allocmap_set(&vmem_map, start);
 	}
-	
-	return (void*)vmem_current;
-}
\ No newline at end of file
+
+	return (void*)vmem_top;
+}
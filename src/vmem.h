@@ -5,9 +5,44 @@
 #include <stdint.h>
 
 // Virtual memory helpers
+void vmem_init(void);
 void *vmalloc(size_t size);
 void vfree(void *ptr);
 size_t vsize(void *ptr);
 void *vbrk(void *new_brk);
+// Start of the vmalloc block containing addr (interior pointers included), or NULL
+void *vmem_owner(const void *addr);
+
+// Map existing frames (physical addresses, in order) into one contiguous window of
+// the vmalloc zone. The frames stay the caller's: vunmap only removes the mapping.
+// flags: PAGE_WRITE and the cache bits. NULL when the VA or page tables run out.
+void *vmap(void *const frames[], uint32_t n, uint32_t flags);
+void vunmap(void *addr);
+
+// Cache modes for ioremap
+#define IOREMAP_WB 0            // Write-back, for RAM-like memory
+#define IOREMAP_WT 1            // Write-through
+#define IOREMAP_UC 2            // Uncached, for device registers
+
+// Map a physical range (MMIO) into the vmalloc zone; the result keeps phys's page offset
+void *ioremap(uint32_t phys, size_t size, uint32_t cache_mode);
+void iounmap(void *addr);
+
+struct vmem_stats {
+	uint32_t used;          // Bytes reserved by live blocks, guard pages excluded
+	uint32_t busy_areas;
+	uint32_t free;          // Free VA left in the zone
+	uint32_t free_areas;
+	uint32_t largest_free;
+	uint32_t lazy;          // Freed bytes still mapped, waiting for a purge
+	uint32_t purges;        // Purge runs, one TLB flush each
+	uint32_t purged_areas;
+	uint32_t purged_pages;  // Frames returned by purges
+	uint32_t max_purge_batch;
+};
+void vmem_stats(struct vmem_stats *st);
+// Unmap every freed block with a single TLB flush and make its VA reusable.
+// vfree parks blocks until VMALLOC_LAZY_MAX bytes are pending or the VA runs out.
+void vmem_purge(void);
 
 #endif
\ No newline at end of file